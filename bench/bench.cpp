@@ -0,0 +1,233 @@
+/*
+ * Benchmarks of the memory and entry layers without FUSE
+ *
+ * Every result is printed as one JSON object per line, so runs can be compared
+ * by scripts. Build with DEBUG=1 to measure against host memory instead of a
+ * graphics card.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "memory.hpp"
+#include "entry.hpp"
+
+using namespace vram;
+
+typedef std::chrono::steady_clock clock_type;
+
+// Every case is repeated until it has run for at least this long
+static double min_time = 0.5;
+
+static std::mt19937_64 rng(1);
+
+static double seconds_since(clock_type::time_point start) {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+// Run *fn* until min_time has passed, returns the number of calls and the
+// total time they took in *seconds*
+template<typename F>
+static size_t repeat(F fn, double& seconds) {
+    auto start = clock_type::now();
+    size_t count = 0;
+
+    do {
+        fn();
+        count++;
+        seconds = seconds_since(start);
+    } while (seconds < min_time);
+
+    return count;
+}
+
+static void print_throughput(const char* bench, const char* mode, size_t size, size_t count, double seconds) {
+    printf("{\"bench\": \"%s\", \"mode\": \"%s\", \"size\": %zu, \"count\": %zu, \"seconds\": %.6f, "
+        "\"latency_us\": %.3f, \"mib_per_s\": %.1f}\n",
+        bench, mode, size, count, seconds, seconds / count * 1e6, size * count / seconds / (1024 * 1024));
+    fflush(stdout);
+}
+
+/*
+ * Pool
+ */
+
+// Grow the pool in doubling steps up to *size*, leaving it allocated for the
+// other benchmarks
+static bool bench_pool(size_t size) {
+    size_t total = 0;
+
+    for (size_t step = 64 * 1024 * 1024; total < size; step = total) {
+        step = std::min(step, size - total);
+
+        auto start = clock_type::now();
+        size_t added = memory::increase_pool(step);
+        double seconds = seconds_since(start);
+
+        total += added;
+
+        printf("{\"bench\": \"pool_grow\", \"size\": %zu, \"total\": %zu, \"seconds\": %.6f}\n", added, total, seconds);
+        fflush(stdout);
+
+        if (added < step) break;
+    }
+
+    return total > 0;
+}
+
+/*
+ * Blocks
+ */
+
+static void bench_blocks() {
+    for (int cls = 0; cls < memory::class_count; cls++) {
+        size_t size = memory::class_size(cls);
+        std::vector<char> data(size, 'x');
+
+        auto block = memory::allocate(cls, memory::next_queue(), 0);
+        if (!block) return;
+
+        double seconds;
+        size_t count = repeat([&] { block->write(0, size, data.data(), false); }, seconds);
+        print_throughput("block_write", "sync", size, count, seconds);
+
+        // Completion of the queued writes is included in the time of the last one
+        count = repeat([&] {
+            for (int i = 0; i < 16; i++) block->write(0, size, data.data(), true);
+            block->sync();
+        }, seconds);
+        print_throughput("block_write", "async", size, count * 16, seconds);
+
+        // Full blocks bypass the host cache
+        count = repeat([&] { block->read(0, size, data.data()); }, seconds);
+        print_throughput("block_read", "full", size, count, seconds);
+
+        // Small reads are served from the cache after the first one
+        size_t small = std::min(size, (size_t) 4096);
+        count = repeat([&] { block->read(size - small, small, data.data()); }, seconds);
+        print_throughput("block_read", "cached", small, count, seconds);
+    }
+}
+
+/*
+ * Files
+ */
+
+static void bench_files(size_t file_size) {
+    for (size_t size = 4096; size <= 16 * 1024 * 1024; size *= 4) {
+        auto root = entry::dir_t::make(nullptr, "");
+        auto file = entry::file_t::make(root.get(), "file");
+
+        std::vector<char> data(size, 'x');
+        size_t requests = file_size / size;
+
+        double seconds;
+        size_t count = repeat([&] {
+            for (size_t i = 0; i < requests; i++) file->write(i * size, size, data.data());
+            file->sync();
+        }, seconds);
+        print_throughput("file_write", "sequential", size, count * requests, seconds);
+
+        count = repeat([&] {
+            for (size_t i = 0; i < requests; i++) file->read(i * size, size, data.data());
+        }, seconds);
+        print_throughput("file_read", "sequential", size, count * requests, seconds);
+
+        count = repeat([&] {
+            for (size_t i = 0; i < requests; i++) file->write(rng() % requests * size, size, data.data());
+            file->sync();
+        }, seconds);
+        print_throughput("file_write", "random", size, count * requests, seconds);
+
+        count = repeat([&] {
+            for (size_t i = 0; i < requests; i++) file->read(rng() % requests * size, size, data.data());
+        }, seconds);
+        print_throughput("file_read", "random", size, count * requests, seconds);
+    }
+}
+
+/*
+ * Directories
+ */
+
+// Walk random paths in a chain of *depth* directories that each have
+// *fanout* children one component at a time, like the lookups of the kernel
+static void bench_lookup(int depth, size_t fanout) {
+    auto root = entry::dir_t::make(nullptr, "");
+
+    entry::dir_ptr dir = root.get();
+    const string chain = "entry0";
+
+    for (int level = 0; level < depth; level++) {
+        for (size_t i = 1; i < fanout; i++) {
+            entry::symlink_t::make(dir, "entry" + std::to_string(i), "target");
+        }
+
+        dir = entry::dir_t::make(dir, chain).get();
+    }
+
+    // Paths differ in the last component
+    std::vector<string> names;
+    for (size_t i = 0; i < 1024; i++) {
+        names.push_back("entry" + std::to_string(rng() % fanout));
+    }
+
+    entry::entry_ref entry;
+    size_t i = 0;
+
+    double seconds;
+    size_t count = repeat([&] {
+        for (int j = 0; j < 1024; j++) {
+            entry = root;
+
+            for (int level = 1; level < depth; level++) {
+                static_cast<entry::dir_ptr>(entry.get())->child(chain, entry);
+            }
+
+            static_cast<entry::dir_ptr>(entry.get())->child(names[i++ % names.size()], entry);
+        }
+    }, seconds) * 1024;
+
+    printf("{\"bench\": \"dir_lookup\", \"depth\": %d, \"fanout\": %zu, \"count\": %zu, "
+        "\"seconds\": %.6f, \"latency_ns\": %.1f}\n", depth, fanout, count, seconds, seconds / count * 1e9);
+    fflush(stdout);
+}
+
+static void bench_dirs() {
+    for (int depth : {1, 4, 16}) {
+        for (size_t fanout : {10, 1000, 10000}) {
+            bench_lookup(depth, fanout);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 3) {
+        fprintf(stderr, "usage: bench [pool MiB] [seconds per case]\n");
+        return 1;
+    }
+
+    size_t pool_size = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 512) * 1024 * 1024;
+    if (argc > 2) min_time = atof(argv[2]);
+
+    if (!memory::is_available()) {
+        fprintf(stderr, "no opencl capable gpu found\n");
+        return 1;
+    }
+
+    if (!bench_pool(pool_size)) {
+        fprintf(stderr, "failed to allocate any memory\n");
+        return 1;
+    }
+
+    bench_blocks();
+    bench_files(std::min(pool_size / 4, (size_t) 64 * 1024 * 1024));
+    bench_dirs();
+
+    return 0;
+}
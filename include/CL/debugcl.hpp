@@ -13,19 +13,43 @@
 
 const int CL_MEM_READ_WRITE = (1 << 0);
 const int CL_MEM_READ_ONLY = (1 << 2);
+const int CL_MEM_ALLOC_HOST_PTR = (1 << 4);
 const int CL_MEM_COPY_HOST_PTR = (1 << 5);
+const int CL_MAP_READ = (1 << 0);
+const int CL_MAP_WRITE = (1 << 1);
 const int CL_SUCCESS = 0;
 const int CL_DEVICE_TYPE_GPU = 0;
 const int CL_COMPLETE = 0;
+const int CL_QUEUE_PROFILING_ENABLE = (1 << 1);
 
 const int CL_DEVICE_NAME = 0x102B;
+const int CL_DEVICE_MAX_MEM_ALLOC_SIZE = 0x1010;
+const int CL_EVENT_COMMAND_TYPE = 0x11D1;
+const int CL_COMMAND_READ_BUFFER = 0x11F3;
+const int CL_COMMAND_WRITE_BUFFER = 0x11F4;
+const int CL_PROFILING_COMMAND_QUEUED = 0x1280;
+const int CL_PROFILING_COMMAND_START = 0x1282;
+const int CL_PROFILING_COMMAND_END = 0x1283;
 
 typedef int cl_event;
 typedef int cl_int;
 typedef unsigned int cl_uint;
+typedef unsigned long cl_ulong;
+typedef cl_uint cl_command_type;
 
 typedef CL_CALLBACK void (*callback_fn)(cl_event, cl_int, void*);
 
+// Commands complete immediately, so they never spend any time queued or executing
+inline cl_int clGetEventInfo(cl_event event, int name, size_t size, void* value, size_t* size_ret) {
+    *reinterpret_cast<cl_command_type*>(value) = CL_COMMAND_WRITE_BUFFER;
+    return CL_SUCCESS;
+}
+
+inline cl_int clGetEventProfilingInfo(cl_event event, int name, size_t size, void* value, size_t* size_ret) {
+    *reinterpret_cast<cl_ulong*>(value) = 0;
+    return CL_SUCCESS;
+}
+
 namespace cl {
     class Device {
     public:
@@ -33,6 +57,11 @@ namespace cl {
         const char* getInfo() {
             return "DEBUG DEVICE";
         }
+
+        int getInfo(int name, cl_ulong* value) {
+            *value = 256 * 1024 * 1024;
+            return CL_SUCCESS;
+        }
     };
 
     class Platform {
@@ -54,6 +83,7 @@ namespace cl {
     public:
         Context() {}
         Context(std::vector<Device>& devices) {}
+        Context(const Device& device) {}
     };
 
     class Buffer {
@@ -62,7 +92,7 @@ namespace cl {
             data = std::make_shared<std::vector<char>>();
         }
 
-        Buffer(Context& ctx, int flags, int64_t size, void* host_ptr = nullptr, int* err = nullptr) {
+        Buffer(const Context& ctx, int flags, int64_t size, void* host_ptr = nullptr, int* err = nullptr) {
             data = std::make_shared<std::vector<char>>();
             data->resize(size);
             if (err) *err = CL_SUCCESS;
@@ -77,8 +107,13 @@ namespace cl {
 
     class Event {
     public:
-        void setCallback(int flag, callback_fn cb, void* userdata) {
+        cl_event operator()() const {
+            return 0;
+        }
+
+        int setCallback(int flag, callback_fn cb, void* userdata) {
             cb(0, 0, userdata);
+            return CL_SUCCESS;
         }
 
         void wait() {}
@@ -87,33 +122,46 @@ namespace cl {
     class CommandQueue {
     public:
         CommandQueue() {}
-        CommandQueue(Context& ctx, Device& device) {}
+        CommandQueue(Context& ctx, Device& device, int properties = 0) {}
 
-        int enqueueFillBuffer(const Buffer& buf, int pattern, int off, int size, std::vector<cl::Event>* events, cl::Event* event) {
+        int enqueueFillBuffer(const Buffer& buf, int pattern, int off, int size, const std::vector<cl::Event>* events, cl::Event* event) {
             memset(&buf.data->operator[](off), 0, size);
             return CL_SUCCESS;
         }
 
-        int enqueueCopyBuffer(const Buffer& src, Buffer& dst, int offSrc, int offDst, int size, std::vector<cl::Event>* events, cl::Event* event) {
+        int enqueueCopyBuffer(const Buffer& src, Buffer& dst, int offSrc, int offDst, int size, const std::vector<cl::Event>* events, cl::Event* event) {
             memcpy(&dst.data->operator[](offDst), &src.data->operator[](offSrc), size);
             return CL_SUCCESS;
         }
 
-        int enqueueReadBuffer(const Buffer& buf, bool block, int off, int size, void* out, std::vector<cl::Event>* events, cl::Event* event) {
+        void* enqueueMapBuffer(const Buffer& buf, bool block, int flags, int off, int size, const std::vector<cl::Event>* events, cl::Event* event, int* err = nullptr) {
+            if (err) *err = CL_SUCCESS;
+            return &buf.data->operator[](off);
+        }
+
+        int enqueueReadBuffer(const Buffer& buf, bool block, int off, int size, void* out, const std::vector<cl::Event>* events, cl::Event* event) {
             memcpy(out, &buf.data->operator[](off), size);
             return CL_SUCCESS;
         }
 
-        int enqueueWriteBuffer(const Buffer& buf, bool block, int off, int size, const void* in, std::vector<cl::Event>* events, cl::Event* event) {
+        int enqueueWriteBuffer(const Buffer& buf, bool block, int off, int size, const void* in, const std::vector<cl::Event>* events, cl::Event* event) {
             memcpy(&buf.data->operator[](off), in, size);
             return CL_SUCCESS;
         }
 
+        int flush() {
+            return CL_SUCCESS;
+        }
+
         int finish() {
             return CL_SUCCESS;
         }
     };
 
+    inline int WaitForEvents(const std::vector<Event>& events) {
+        return CL_SUCCESS;
+    }
+
     namespace detail {
         inline cl_uint getPlatformVersion(void* platform) {
             return 0;
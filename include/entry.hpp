@@ -5,17 +5,19 @@
  * Entry types
  */
 
+#include <cstdint>
 #include <string>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
-#include <map>
+#include <vector>
 #include <unordered_map>
 
 #include "memory.hpp"
 #include "util.hpp"
 
 using std::string;
-using std::shared_ptr;
 
 namespace vram {
     namespace entry {
@@ -25,10 +27,10 @@ namespace vram {
         class dir_t;
         class symlink_t;
 
-        typedef shared_ptr<entry_t> entry_ref;
-        typedef shared_ptr<file_t> file_ref;
-        typedef shared_ptr<dir_t> dir_ref;
-        typedef shared_ptr<symlink_t> symlink_ref;
+        typedef util::ref<entry_t> entry_ref;
+        typedef util::ref<file_t> file_ref;
+        typedef util::ref<dir_t> dir_ref;
+        typedef util::ref<symlink_t> symlink_ref;
 
         typedef entry_t* entry_ptr;
         typedef file_t* file_ptr;
@@ -51,14 +53,27 @@ namespace vram {
         int count();
 
         // Full description of entry
-        class entry_t : public std::enable_shared_from_this<entry_t> {
+        //
+        // The parent, name and directory children are protected by the
+        // namespace lock held by the caller, attributes lock themselves.
+        //
+        // Entries are allocated from slabs shared by all entries of the same
+        // size, because there may be millions of them and all of that memory
+        // is locked.
+        class entry_t : public util::ref_counted {
         public:
             entry_t(const entry_t& other) = delete;
 
+            static void* operator new(size_t size);
+            static void operator delete(void* ptr, size_t size);
+
             dir_ptr parent() const;
 
             const string& name() const;
 
+            // Unique number of the entry, which is never reused
+            uint64_t ino() const;
+
             virtual ~entry_t();
 
             virtual type::type_t type() const = 0;
@@ -82,6 +97,17 @@ namespace vram {
             void user(uid_t user);
             void group(gid_t group);
 
+            // Extended attributes, kept in host memory. Getting one stores
+            // its value in *value*, setting one takes the XATTR_CREATE and
+            // XATTR_REPLACE flags of setxattr(), all return -error or 0.
+            int xattr(const string& name, string& value) const;
+            int xattr(const string& name, const string& value, int flags);
+            int remove_xattr(const string& name);
+
+            // Names of all extended attributes, each followed by a null byte
+            // like the list of listxattr()
+            string xattr_names() const;
+
             // Remove link with parent directory
             void unlink();
 
@@ -95,18 +121,29 @@ namespace vram {
             void link(dir_ptr parent, const string& name);
 
         private:
-            // Non-owning pointer, parent is guaranteed to exist if entry exists
-            dir_ptr _parent = nullptr;
-
-            string _name;
+            // Mode, owner and times may be accessed by concurrent readers of the
+            // namespace, they're guarded by one of a small set of shared locks
+            std::mutex& attr_mutex() const;
 
             mode_t _mode = 0;
             uid_t _user = 0;
             gid_t _group = 0;
 
-            timespec _atime;
-            timespec _mtime;
-            timespec _ctime;
+            // Extended attributes by name, only allocated once one is set
+            std::unique_ptr<std::map<string, string>> _xattrs;
+
+            const uint64_t _ino;
+
+            // Non-owning pointer, parent is guaranteed to exist if entry exists
+            dir_ptr _parent = nullptr;
+
+            // Also the key of the entry in the children of its parent
+            string _name;
+
+            // Nanoseconds since the epoch
+            int64_t _atime;
+            int64_t _mtime;
+            int64_t _ctime;
         };
 
         // File entry
@@ -119,38 +156,200 @@ namespace vram {
 
             size_t size() const;
 
-            // Blocks beyond the new file size are immediately deallocated
-            void size(size_t new_size);
+            // Blocks beyond the new file size are immediately deallocated,
+            // returns -error or 0
+            int size(size_t new_size);
 
             // Read data from file, returns total bytes read <= size
             //
-            // The specified mutex is unlocked while blocking to read, because
-            // that's a non-critical section.
-            int read(off_t off, size_t size, char* data, std::mutex& wait_mutex);
+            // Multiple threads may read from the same file simultaneously.
+            int read(off_t off, size_t size, char* data);
+
+            // Start reading the blocks in the specified region into the host cache
+            void prefetch(off_t off, size_t size) const;
 
             // Write data to file, returns -error or total bytes written
+            //
+            // Small asynchronous writes that follow each other within a block
+            // are collected in host memory and transferred together.
             int write(off_t off, size_t size, const char* data, bool async = true);
 
-            // Sync writes to file
+            // Copies the next *size* bytes of the written data to *dst*,
+            // returns false if they couldn't be read
+            typedef std::function<bool(char* dst, size_t size)> write_source;
+
+            // Asynchronously write data that can only be read in order, like a
+            // pipe, which is copied straight into the staging memory
+            int write(off_t off, size_t size, const write_source& source);
+
+            // Allocate the blocks in the specified region, the file grows to
+            // cover it unless *keep_size* is set, returns -error or 0
+            int preallocate(off_t off, size_t size, bool keep_size);
+
+            // Same as above, but existing data in the region is replaced with zeros
+            int zero_range(off_t off, size_t size, bool keep_size);
+
+            // Deallocate the blocks within the region and clear the parts of
+            // blocks that it partially covers, the size stays the same,
+            // returns -error or 0
+            int punch_hole(off_t off, size_t size);
+
+            // Copy data from another file (or this one) without passing through
+            // the host, returns -error or total bytes copied
+            //
+            // Whole blocks at the same position in both layouts are shared
+            // instead, until one of the files writes to them.
+            int copy(off_t off, size_t size, file_t& src, off_t src_off);
+
+            // Unlinked copy of the file that shares all of its blocks, until
+            // either of them writes to one
+            file_ref clone();
+
+            // Offset of the first data (SEEK_DATA) or hole (SEEK_HOLE) at or
+            // after *off*, returns -ENXIO if there is none before the end of
+            // the file (which counts as a hole)
+            off_t seek(off_t off, int whence) const;
+
+            // Start transferring collected writes without waiting for them
+            void flush();
+
+            // Wait for all writes to the file to complete, writes of other
+            // files are only waited for if they were issued before them on the
+            // same queue
             void sync();
 
+            // Same as above, but returns right away and calls *done* once the
+            // writes have completed, possibly on another thread
+            void sync(const std::function<void()>& done);
+
         private:
-            // Data blocks if this entry is a file
-            std::map<off_t, memory::block_ref> file_blocks;
+            // Sequential writes to a single block that haven't been transferred
+            // yet, the staging buffer holds the data from *begin* onwards
+            struct write_back_t {
+                memory::block_ref block;
+                size_t block_index = 0;
+                memory::staging_ref staging;
+                off_t begin = 0;
+                off_t end = 0;
+            };
 
-            // Last block touched by write()
-            memory::block_ref last_written_block;
+            // Hash of the data of a block that is written in order from its
+            // start, so that it can still be shared once it's full if no
+            // single write covers it, which is the case for the larger classes
+            struct written_hash_t {
+                size_t block_index = SIZE_MAX;
+                off_t end = 0;
+                util::hasher hasher;
+            };
+
+            // Shared by readers, exclusive for anything that changes the
+            // blocks, the size or the last written block
+            mutable util::rwlock file_lock;
+
+            // Blocks by their number in the layout of the file, missing blocks
+            // are nullptr
+            //
+            // Numbers up to a few times the count of blocks are kept in an
+            // array, so dense files are indexed in constant time. Blocks far
+            // beyond that go into a sorted map, so that a write at a huge
+            // offset doesn't cost memory for all of the holes before it.
+            class block_table {
+            public:
+                const memory::block_ref& get(size_t index) const;
+
+                // Store a block, or remove it with nullptr
+                void set(size_t index, const memory::block_ref& block);
+
+                // Remove all blocks with a number >= *index*
+                void truncate(size_t index);
+
+                // True if there are no blocks at all
+                bool empty() const { return count == 0; }
+
+                // Number of the first block at or after *index*, returns
+                // SIZE_MAX if there is none
+                size_t next(size_t index) const;
+
+            private:
+                std::vector<memory::block_ref> dense;
+                std::map<size_t, memory::block_ref> sparse;
+                size_t count = 0;
+            };
+
+            block_table file_blocks;
+
+            // Last writes of the file on every queue it used, which includes
+            // those of other files for blocks that are shared
+            memory::write_set pending_writes;
+
+            write_back_t write_back;
+
+            written_hash_t written_hash;
+
+            // Contents of a small file without blocks, which are kept in host
+            // memory as long as all of its data fits in the first inline_size
+            // bytes. Anything beyond the file size is zero.
+            std::unique_ptr<char[]> inline_data;
 
             // File size
             size_t _size = 0;
 
+            // Command queue used for the blocks of this file, which keeps its
+            // transfers in order and apart from those of most other files
+            const size_t queue;
+
             file_t();
 
-            // Get the OpenCL buffer of the block if it exists or a nullptr
-            memory::block_ref get_block(off_t off) const;
+            // Read from blocks with the file lock held and nothing collected for write-back
+            int read_blocks(off_t off, size_t size, char* data);
+
+            // Implementation of write(), data is taken from *source* if set
+            int write_blocks(off_t off, size_t size, const char* data, const write_source* source, bool async);
+
+            // Transfer the collected writes to their block
+            void flush_write_back();
+
+            // Move inline data to the first block before the file grows
+            // beyond it, returns -error or 0
+            int move_inline();
+
+            // Start transferring collected writes and return the writes to wait for
+            memory::write_set flushed_writes();
+
+            // Get the block with the specified index if it exists or a nullptr
+            const memory::block_ref& get_block(size_t index) const;
+
+            // Allocate new block of the specified class, returns nullptr on failure
+            const memory::block_ref& alloc_block(size_t index, int cls);
 
-            // Allocate new block, buf is only set on success (returning true)
-            memory::block_ref alloc_block(off_t off);
+            // Implementation of preallocate() and zero_range()
+            int allocate_blocks(off_t off, size_t size, bool zero, bool keep_size);
+
+            // Add the data written to a block to its hash if it continues the
+            // data hashed so far or starts at the beginning, *data* may be
+            // nullptr if it isn't available, returns true once all of the
+            // block has been hashed
+            bool hash_written(size_t index, off_t offset, const char* data, size_t size, size_t block_size);
+
+            // Share a block that was hashed entirely with another one of the
+            // same contents, or make it available to later writers otherwise
+            void share_written(size_t index, int cls);
+
+            // Implementation of copy() with the locks of both files held
+            int copy_blocks(off_t off, size_t size, file_t& src, off_t src_off);
+
+            // True if the block is shared with another file (or another
+            // position in this one)
+            bool is_shared(const memory::block_ref& block) const;
+
+            // Get the block with the specified index for writing, which
+            // allocates it if needed and replaces it with a private copy if
+            // it's shared, unless *keep_data* is false, returns nullptr on failure
+            memory::block_ref writable_block(size_t index, int cls, bool keep_data = true);
+
+            // Clear part of an allocated block without waiting for it, returns
+            // -error or 0
+            int zero_block(size_t index, int cls, off_t offset, size_t size);
 
             // Delete all blocks with a starting offset >= *off*
             void free_blocks(off_t off = 0);
@@ -169,17 +368,46 @@ namespace vram {
             // Always returns size of 4096
             size_t size() const;
 
-            // Not const, because it changes access time
-            const std::unordered_map<string, entry_ref> children();
+            // Called for each child, returns false to stop listing
+            typedef std::function<bool(const entry_ref& entry)> child_visitor;
+
+            // List children in order of their inode numbers, starting with the
+            // first one after *after*, so a listing can be continued from the
+            // last child it visited even if the directory changed in between
+            //
+            // Not const, because it changes access time.
+            void list(uint64_t after, const child_visitor& visit);
+
+            bool empty() const;
 
             // Find entry by path relative to this entry
             int find(const string& path, entry_ref& entry, int filter = type::all) const;
 
+            // Find direct child of this directory by name
+            int child(const string& name, entry_ref& entry, int filter = type::all) const;
+
         protected:
-            std::unordered_map<string, entry_ref> _children;
+            // Hashes the name that a key points to
+            struct name_hash {
+                size_t operator()(const string* name) const { return std::hash<string>()(*name); }
+            };
+
+            struct name_equal {
+                bool operator()(const string* a, const string* b) const { return *a == *b; }
+            };
+
+            // Children by name and by inode number, the keys of the first point
+            // to the names stored in the entries themselves
+            std::unordered_map<const string*, entry_ptr, name_hash, name_equal> _children;
+            std::map<uint64_t, entry_ref> _listing;
 
         private:
             dir_t();
+
+            // Add a child by its current name, replacing any other entry with
+            // that name, or remove it
+            void add_child(const entry_ref& entry);
+            void remove_child(const entry_t* entry);
         };
 
         // Symlink entry
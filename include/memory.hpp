@@ -14,63 +14,357 @@
     #include <CL/cl2.hpp>
 #endif
 
+#include <sys/types.h>
+
+#include "util.hpp"
+
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace vram {
     namespace memory {
         class block;
         typedef std::shared_ptr<block> block_ref;
 
+        struct chunk;
+        struct gpu;
+
+        struct cache_entry;
+        typedef std::shared_ptr<cache_entry> cache_ref;
+
+        struct spill_copy;
+        typedef std::shared_ptr<spill_copy> spill_ref;
+
+        // Block size classes from small to large (4K, 64K, 1M and 16M), each
+        // size is a multiple of the previous one
+        const int class_count = 4;
+
+        size_t class_size(int cls);
+
+        // Find the class with exactly the specified block size, returns -1 if
+        // there is no such class
+        int find_class(size_t size);
+
+        // Class of the first blocks of a file
+        void set_default_class(int cls);
+        int default_class();
+
+        // Share blocks with identical contents between files, which are
+        // recognised by a hash of the data (disabled by default)
+        void set_dedup(bool enabled);
+        bool dedup_enabled();
+
+        // Run the threads started from then on near the first device and let
+        // them prefer host memory of its NUMA node, including the staging
+        // buffers and the host cache (enabled by default)
+        //
+        // The calling thread is bound by is_available(), if the node of the
+        // device is known and the machine has more than one.
+        void set_numa_binding(bool enabled);
+
+        // Node that threads were bound to, or -1 if they weren't
+        int numa_node();
+
+        // Limit the bytes of transfers that nobody waits for that may be in
+        // flight per device, beyond *write_back* asynchronous writes wait for
+        // earlier ones to complete and beyond *prefetch* prefetches are dropped
+        //
+        // Reads that are waited for go through separate queues, so they only
+        // wait for writes to their own blocks, and these limits bound how much
+        // the device has to work through besides them.
+        void set_background_limits(size_t write_back, size_t prefetch);
+
         // Check if current machine supports VRAM allocation
         bool is_available();
 
-        // Set the device to use
-        void set_device(size_t num);
+        // Set the devices to use, blocks are striped over all of them
+        void set_devices(const std::vector<size_t>& nums);
+
+        // Number of devices in use
+        size_t device_count();
 
         // Returns a list of device names
         std::vector<std::string> list_devices();
 
-        // Total blocks and blocks currently free
-        int pool_size();
-        int pool_available();
+        // Total bytes and bytes currently free, including memory that the pool
+        // may still grow by
+        size_t pool_size();
+        size_t pool_available();
 
-        // Allocate pool of memory blocks, returns actual amount allocated (in bytes)
+        // Bytes of VRAM that are currently allocated
+        size_t pool_allocated();
+
+        // Allocate pool of memory, returns actual amount allocated (in bytes)
+        //
+        // Memory is allocated in a few large slabs, which are divided into
+        // chunks of the largest block size. Chunks are split into blocks of a
+        // single class while they're in use.
         size_t increase_pool(size_t size);
 
-        // Get a new block of memory from the pool, returns nullptr if pool is empty
-        block_ref allocate();
+        // Let the pool grow in the background up to *limit* bytes as it runs
+        // low, and release slabs that have been unused for *idle_release*
+        // seconds (never if 0), without shrinking below the current size
+        void grow_pool(size_t limit, unsigned idle_release);
+
+        // Evict the least recently used blocks to a file in *dir* once the
+        // pool is full, instead of failing allocations, returns false if the
+        // file couldn't be created
+        //
+        // Evicted blocks are loaded back into VRAM when they're accessed.
+        bool set_spill_dir(const std::string& dir);
+
+        // Largest amount of data that can be prepared in a staging buffer
+        const size_t staging_size = 1024 * 1024;
+
+        // Pinned host memory of staging_size bytes to prepare a write in
+        struct staging_buffer {
+            cl::Buffer buffer;
+            char* data;
+        };
+
+        // Returns a staging buffer to the pool when it's no longer needed
+        struct staging_release {
+            void operator()(staging_buffer* staging) const;
+        };
+
+        typedef std::unique_ptr<staging_buffer, staging_release> staging_ref;
+
+        // Take a free staging buffer, returns nullptr if all are in use
+        staging_ref acquire_staging();
+
+        // Pick a command queue for a new stream of transfers (round-robin)
+        size_t next_queue();
+
+        // Get a new block of the specified class from the pool, returns nullptr
+        // if the pool is empty
+        //
+        // All transfers of the block are issued on the specified queue, so they
+        // execute in order with those of other blocks on the same queue of the
+        // same device. Consecutive *stripe* numbers are placed on the devices
+        // round-robin, unless the device of a stripe is full.
+        block_ref allocate(int cls, size_t queue, size_t stripe);
+
+        // Get a published block of the class with the specified hash of its
+        // contents, returns nullptr if there is none or if its data turns out
+        // to differ from *data* (which is read back to compare it)
+        block_ref find_block(int cls, const util::hash128& contents, const char* data);
+
+        // Same as above, but compares with the data of another block
+        block_ref find_block(int cls, const util::hash128& contents, const block& data);
+
+        /*
+         * Transfers of a request that spans multiple blocks
+         */
+
+        // Reads and writes of several blocks are issued without waiting for
+        // each other and then waited for at once. Reads of blocks that are
+        // adjacent in VRAM are merged into a single transfer. Blocks can't be
+        // evicted until the reads from them have completed.
+        class transfer_batch {
+            friend class block;
+
+        public:
+            transfer_batch() = default;
+            transfer_batch(const transfer_batch& other) = delete;
+
+            ~transfer_batch();
+
+            // Issue remaining transfers and wait for all of them to complete
+            void wait();
+
+        private:
+            // Read that may still be extended by the next one
+            struct pending_read {
+                size_t queue;
+                const chunk* owner = nullptr;
+                off_t offset;
+                size_t size = 0;
+                char* data;
+                std::vector<cl::Event> wait; // last writes of the blocks
+            } pending;
+
+            std::vector<cl::Event> events;
+
+            // Blocks with pending reads, which can't be evicted until they're done
+            std::vector<const block*> pinned;
+
+            void read(const block* source, off_t offset, size_t size, char* data);
+            void issue();
+        };
+
+        /*
+         * Writes that may still be in flight
+         */
+
+        // Keeps the last write issued on every queue of every device that a
+        // set of blocks was written through. Queues execute in order, so the
+        // completion of those implies that of all earlier writes on them.
+        class write_set {
+        public:
+            // Remember the last write issued to the block, including clears and copies
+            void add(const block& written);
+
+            // Wait for all remembered writes to complete
+            void wait() const;
+
+            // Same as above, but returns right away and calls *done* once they
+            // have completed, which may happen on another thread
+            void wait(const std::function<void()>& done) const;
+
+        private:
+            // Indexed by device and queue, null events for queues never written to
+            std::vector<cl::Event> events;
+        };
 
         /*
          * Block of allocated VRAM
          */
 
         class block : public std::enable_shared_from_this<block> {
-            friend block_ref allocate();
+            friend block_ref allocate(int cls, size_t queue, size_t stripe);
+            friend bool evict(gpu& dev, int cls);
+            friend class transfer_batch;
+            friend class write_set;
 
         public:
-            // Best performance/size balance
-            static const size_t size = 128 * 1024;
-
             block(const block& other) = delete;
 
             ~block();
 
+            // Size of the block in bytes
+            size_t size() const;
+
+            // Index of the device that the block is stored on
+            size_t device() const;
+
+            // Partial reads are served from a host cache of recently read data
             void read(off_t offset, size_t size, void* data) const;
 
-            // Data may be freed afterwards, even if called with async = true
+            // Same as above, but the data is only available after the batch
+            // has been waited for
+            void read(off_t offset, size_t size, void* data, transfer_batch& batch) const;
+
+            // Start reading the specified region into the cache without waiting
+            // for it, behind the writes to the block, the rest of the region is
+            // skipped if too many prefetches are in flight
+            void prefetch(off_t offset, size_t size) const;
+
+            // Data may be freed afterwards, even if called with async = true,
+            // which waits first if too many asynchronous writes are in flight
             void write(off_t offset, size_t size, const void* data, bool async = false);
 
-            // Wait for all writes to this block to complete
+            // Data must stay valid until the batch has been waited for
+            void write(off_t offset, size_t size, const void* data, transfer_batch& batch);
+
+            // Asynchronously write data prepared in a staging buffer, starting
+            // at *staging_offset*, the buffer is released when it completes
+            //
+            // Never waits for other asynchronous writes, the number of staging
+            // buffers limits how many of these can be in flight.
+            void write(off_t offset, size_t size, staging_ref staging, off_t staging_offset = 0);
+
+            // Fill part of the block with zeros without waiting for it
+            void zero(off_t offset, size_t size);
+
+            // Copy data from another block without waiting for it, the copy
+            // stays on the device unless the blocks are on different devices
+            void copy(off_t offset, size_t size, const block& src, off_t src_offset);
+
+            // Wait for all writes to this block to complete, which also covers
+            // earlier writes to other blocks on the same queue and device
             void sync();
 
+            // Make the block available to find_block() by the hash of the data
+            // that was just written to all of it, unless another block with
+            // the same contents is published already
+            void publish(const util::hash128& contents);
+
+            // Stop sharing the block with writers of the same contents, which
+            // is required before modifying a block that isn't shared (yet)
+            void unpublish();
+
         private:
-            cl::Buffer buffer;
-            cl::Event last_write;
+            // Held while the block is accessed, so it isn't evicted halfway
+            mutable std::mutex residency;
+
+            // Reads that have been added to a batch but not issued yet
+            mutable std::atomic<int> pins;
+
+            // Chunk that the block is part of and its position within the slab,
+            // nullptr while the block is evicted, which may change on any access
+            mutable chunk* owner;
+            mutable off_t offset;
+            int cls;
+
+            // Position in the list of blocks of the chunk
+            mutable size_t chunk_index;
+
+            // Device that the block was last stored on
+            mutable size_t device_index;
+
+            mutable cl::Event last_write;
+
+            // Copies from the block to blocks on other queues, by the queue they
+            // were issued on, which have to complete before it's changed or its
+            // memory is reused
+            mutable std::vector<cl::Event> copies;
+
+            // Data of the block while it's evicted, nullptr for blocks that
+            // hadn't been written to yet
+            mutable spill_ref spilled;
+
+            // Index of the command queue used for all transfers
+            size_t queue_num;
+
+            // Parts of the block that have been written to, a bit for every
+            // 64th of it, the others contain leftover data from the last use
+            // of the memory and read as zeros
+            mutable uint64_t written = 0;
+
+            // Hash that the block can be found by, requires dedup_mutex
+            bool published = false;
+            util::hash128 contents;
+
+            block(chunk* owner, off_t offset, int cls, size_t queue, cl::Event last_write, std::vector<cl::Event> copies);
+
+            // Load the block back into VRAM if it has been evicted and mark it
+            // as recently used, requires the residency lock
+            void load(std::unique_lock<std::mutex>& local_lock) const;
+
+            // Move the data to the spill file and give up the VRAM, requires
+            // the residency lock and pool_mutex
+            void evict();
+
+            // Return the VRAM of the block to the pool, requires pool_mutex
+            void release() const;
+
+            // Cached copy of the line starting at *line*, read into the cache if
+            // *fill* is set, as a prefetch if *ahead* is set (which returns
+            // nullptr if too many are in flight)
+            cache_ref cached(off_t line, bool fill, bool ahead = false) const;
+
+            // Drop cached copies of the lines that overlap the region
+            void uncache(off_t offset, size_t size);
+
+            // Clear the specified pieces, the first command waits for *wait_list*
+            // if anything is cleared, which is reset to nullptr then
+            void clear_pieces(uint64_t pieces, const std::vector<cl::Event>*& wait_list) const;
+
+            // Add the commands that the next change to the block has to wait
+            // for to *wait*, which it's ordered after from then on
+            void write_dependencies(std::vector<cl::Event>& wait) const;
 
-            // True until first write (until then it contains leftover data from last use)
-            bool dirty = true;
+            // Clear all pieces that haven't been written to yet
+            void clear_unwritten() const;
 
-            block();
+            // Issue a write, clearing the pieces it covers only partially first
+            // if they haven't been written to yet, returns the OpenCL error
+            // code, the block is left as it was if it isn't CL_SUCCESS
+            int enqueue_write(off_t offset, size_t size, const void* data, bool blocking, cl::Event& event);
         };
     }
 }
@@ -0,0 +1,27 @@
+#ifndef VRAM_NUMA_HPP
+#define VRAM_NUMA_HPP
+
+/*
+ * Placement of threads and host memory on multi-socket machines
+ */
+
+#include <string>
+
+using std::string;
+
+namespace vram {
+    namespace numa {
+        // NUMA node that the PCI device at *address* (like 0000:65:00.0) is
+        // attached to, returns -1 if it's unknown or the machine has only one
+        int device_node(const string& address);
+
+        // Prefer the memory of the node for allocations of the calling thread
+        // and run it on the CPUs of the node, returns false if the memory
+        // policy couldn't be set, failing to move the thread only warns
+        //
+        // Threads started by it afterwards inherit both.
+        bool bind(int node);
+    }
+}
+
+#endif
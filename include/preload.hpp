@@ -0,0 +1,27 @@
+#ifndef VRAM_PRELOAD_HPP
+#define VRAM_PRELOAD_HPP
+
+/*
+ * Populating the file system before it's mounted
+ */
+
+#include <string>
+
+#include "entry.hpp"
+
+using std::string;
+
+namespace vram {
+    namespace preload {
+        // Copy the tree of the directory at *path* into *root*, the contents
+        // of files are read by several threads at once and written to their
+        // blocks asynchronously, returns false after printing an error if
+        // anything couldn't be copied
+        //
+        // Only directories, regular files and symlinks are copied, hard links
+        // become separate files.
+        bool load(entry::dir_ptr root, const string& path);
+    }
+}
+
+#endif
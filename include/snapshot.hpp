@@ -0,0 +1,58 @@
+#ifndef VRAM_SNAPSHOT_HPP
+#define VRAM_SNAPSHOT_HPP
+
+/*
+ * Images of the entire file system
+ */
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "entry.hpp"
+
+using std::string;
+
+namespace vram {
+    namespace snapshot {
+        // Entry of a captured tree, every directory is followed by its children
+        // and a node of type none that ends them
+        struct node {
+            entry::type::type_t type;
+            string name;
+
+            mode_t mode;
+            uid_t user;
+            gid_t group;
+            timespec atime;
+            timespec mtime;
+
+            // Extended attributes by name
+            std::vector<std::pair<string, string>> xattrs;
+
+            // Copy of a file, which shares the blocks of the original until
+            // either of them is written to
+            entry::file_ref file;
+
+            string target;
+        };
+
+        typedef std::vector<node> tree;
+
+        // Capture the tree of *root* at this moment, which requires the
+        // namespace to stay the same meanwhile, returns false after printing
+        // an error if the files couldn't be copied
+        bool capture(entry::dir_ptr root, tree& nodes);
+
+        // Write a captured tree with the contents of its files to an image
+        // at *path*, which is replaced once it's complete, returns false after
+        // printing an error
+        bool save(const tree& nodes, const string& path);
+
+        // Recreate the tree of an image in *root*, returns false after
+        // printing an error
+        bool restore(entry::dir_ptr root, const string& path);
+    }
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef VRAM_STATS_HPP
+#define VRAM_STATS_HPP
+
+/*
+ * Performance counters and latency histograms
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+using std::string;
+
+namespace vram {
+    namespace stats {
+        typedef std::chrono::steady_clock clock;
+
+        // Directory in the root with the file that reports the statistics,
+        // which hides any entry with the same name
+        const char* const dir_name = ".vramfs";
+
+        // File system operations that are timed
+        namespace op {
+            enum op_t {
+                lookup,
+                forget,
+                getattr,
+                setattr,
+                readlink,
+                setxattr,
+                getxattr,
+                listxattr,
+                removexattr,
+                opendir,
+                readdir,
+                create,
+                mkdir,
+                symlink,
+                unlink,
+                rmdir,
+                rename,
+                open,
+                read,
+                write,
+                fsync,
+                flush,
+                fallocate,
+                copy_file_range,
+                lseek,
+                release,
+                statfs,
+                count
+            };
+        }
+
+        // Events that are counted
+        namespace counter {
+            enum counter_t {
+                bytes_read,
+                bytes_written,
+                bytes_from_device,
+                bytes_to_device,
+                bytes_copied,
+                bytes_zero,
+                bytes_deduplicated,
+                cache_hits,
+                cache_misses,
+                blocks_evicted,
+                blocks_loaded,
+                writes_throttled,
+                prefetches_dropped,
+                count
+            };
+        }
+
+        // Record an operation that started at *start* and just completed
+        void record(op::op_t op, clock::time_point start);
+
+        // Times an operation from construction to destruction
+        class timer {
+        public:
+            timer(op::op_t op) : op(op), start(clock::now()) {}
+            timer(const timer& other) = delete;
+            ~timer() { record(op, start); }
+
+        private:
+            op::op_t op;
+            clock::time_point start;
+        };
+
+        void add(counter::counter_t counter, uint64_t n = 1);
+
+        // Record the time since *start* spent waiting for the namespace lock
+        void lock_wait(clock::time_point start, bool exclusive);
+
+        // Record a transfer between host and device that waited *queued_ns* in
+        // its command queue and then took *run_ns* to execute
+        void transfer(bool to_device, uint64_t queued_ns, uint64_t run_ns);
+
+        // All of the above and the pool occupancy as text
+        string report();
+    }
+}
+
+#endif
@@ -5,29 +5,170 @@
  * Utility functions
  */
 
-#define FUSE_USE_VERSION 30
-#include <fuse.h>
+#include <pthread.h>
 
+#include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <string>
+#include <type_traits>
+#include <utility>
 
 using std::string;
 
 namespace vram {
     namespace util {
         // Error function that can be combined with a return statement to return *ret*
+        //
+        // The signal handlers of the FUSE session end its loop and unmount.
         template<typename T>
         T fatal_error(const string& error, T ret) {
             std::cerr << "error: " << error << std::endl;
-            fuse_exit(fuse_get_context()->fuse);
+            raise(SIGTERM);
             return ret;
         }
 
         // Get current time with nanosecond precision
         timespec time();
 
+        // Times in nanoseconds, which covers the years 1678 to 2262, anything
+        // outside of that is clamped
+        int64_t to_nanoseconds(timespec t);
+        timespec to_timespec(int64_t t);
+
         // Split path/to/file.txt into "path/to" and "file.txt"
         void split_file_path(const string& path, string& dir, string& file);
+
+        // True if all bytes of the data are zero
+        bool is_zero(const char* data, size_t size);
+
+        // 128-bit hash of data, which is fast but not meant to withstand
+        // deliberately crafted collisions, so matches still need to be
+        // confirmed by comparing the data
+        struct hash128 {
+            uint64_t low;
+            uint64_t high;
+
+            bool operator==(const hash128& other) const { return low == other.low && high == other.high; }
+        };
+
+        hash128 hash(const char* data, size_t size);
+
+        // Same hash as above of data that is passed in several parts
+        class hasher {
+        public:
+            void add(const char* data, size_t size);
+
+            hash128 result() const;
+
+        private:
+            uint64_t h1 = 0;
+            uint64_t h2 = 0;
+            uint64_t length = 0;
+
+            // Last length % 16 bytes, which don't fill a whole part yet
+            char tail[16];
+        };
+
+        // Reader/writer lock, exclusive ownership works with std::lock_guard
+        class rwlock {
+        public:
+            rwlock();
+            rwlock(const rwlock& other) = delete;
+            ~rwlock();
+
+            void lock();
+            void unlock();
+
+            void lock_shared();
+            void unlock_shared();
+
+        private:
+            pthread_rwlock_t handle;
+        };
+
+        // Scoped shared ownership of a rwlock
+        class shared_lock {
+        public:
+            shared_lock(rwlock& lock) : lock(lock) { lock.lock_shared(); }
+            shared_lock(const shared_lock& other) = delete;
+            ~shared_lock() { lock.unlock_shared(); }
+
+        private:
+            rwlock& lock;
+        };
+
+        template<typename T>
+        class ref;
+
+        // Base of objects managed through ref<T>, which keeps the reference
+        // count in the object itself instead of in a separate control block
+        class ref_counted {
+            template<typename T>
+            friend class ref;
+
+        public:
+            ref_counted() : refs(0) {}
+            ref_counted(const ref_counted& other) = delete;
+
+        private:
+            mutable std::atomic<uint32_t> refs;
+
+            void acquire() const { refs.fetch_add(1, std::memory_order_relaxed); }
+
+            // Returns true if the last reference was released
+            bool release() const { return refs.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+        };
+
+        // Intrusive counterpart of shared_ptr, the object is deleted with its
+        // last reference
+        template<typename T>
+        class ref {
+        public:
+            ref() : ptr(nullptr) {}
+            ref(std::nullptr_t) : ptr(nullptr) {}
+            explicit ref(T* ptr) : ptr(ptr) { if (ptr) ptr->acquire(); }
+
+            ref(const ref& other) : ref(other.ptr) {}
+            ref(ref&& other) : ptr(other.ptr) { other.ptr = nullptr; }
+
+            template<typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+            ref(const ref<U>& other) : ref(other.get()) {}
+
+            ~ref() { if (ptr && ptr->release()) delete ptr; }
+
+            ref& operator=(ref other) {
+                std::swap(ptr, other.ptr);
+                return *this;
+            }
+
+            T* get() const { return ptr; }
+            T& operator*() const { return *ptr; }
+            T* operator->() const { return ptr; }
+
+            explicit operator bool() const { return ptr != nullptr; }
+
+        private:
+            T* ptr;
+        };
+
+        template<typename T, typename U>
+        bool operator==(const ref<T>& a, const ref<U>& b) { return a.get() == b.get(); }
+
+        template<typename T, typename U>
+        bool operator!=(const ref<T>& a, const ref<U>& b) { return a.get() != b.get(); }
+
+        template<typename T, typename U>
+        ref<T> static_pointer_cast(const ref<U>& other) {
+            return ref<T>(static_cast<T*>(other.get()));
+        }
+
+        template<typename T, typename U>
+        ref<T> dynamic_pointer_cast(const ref<U>& other) {
+            return ref<T>(dynamic_cast<T*>(other.get()));
+        }
     }
 }
 
@@ -4,6 +4,7 @@
 #include <thread>
 #include <memory>
 #include <mutex>
+#include <atomic>
 
 #include "util.hpp"
 #include "memory.hpp"
@@ -12,14 +13,20 @@
 using std::lock_guard;
 using std::mutex;
 using std::string;
-using std::dynamic_pointer_cast;
+using vram::util::dynamic_pointer_cast;
 
 namespace vram {
     // Data persistent in an open() and release() session
     struct file_session {
         entry::file_ref file;
 
-        file_session(entry::file_ref file) : file(file) {}
+        // End of the last read, used to detect sequential access
+        std::atomic<off_t> read_end;
+
+        // Writes only return once they have reached the device (O_DIRECT)
+        const bool sync_writes;
+
+        file_session(entry::file_ref file, bool sync_writes) : file(file), read_end(0), sync_writes(sync_writes) {}
     };
 }
 
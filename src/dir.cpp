@@ -1,10 +1,24 @@
 #include "entry.hpp"
 #include "util.hpp"
 
-#include <sstream>
-
 namespace vram {
     namespace entry {
+        // Returns an appropriate error if an undesired type of entry was found
+        static int check_type(const entry_ref& entry, int filter) {
+            if (entry->type() & filter) return 0;
+
+            if (entry->type() == type::file) {
+                if (filter & type::dir) return -ENOTDIR;
+                return -EINVAL;
+            } else if (entry->type() == type::dir) {
+                if (filter & type::file) return -EISDIR;
+                return -EINVAL;
+            } else {
+                if (filter & type::dir) return -ENOTDIR;
+                return -EPERM;
+            }
+        }
+
         dir_ref dir_t::make(dir_ptr parent, const string& name) {
             auto dir = dir_ref(new dir_t());
             dir->link(parent, name);
@@ -23,10 +37,37 @@ namespace vram {
             return 4096;
         }
 
-        const std::unordered_map<string, entry_ref> dir_t::children() {
+        void dir_t::list(uint64_t after, const child_visitor& visit) {
             atime(util::time());
 
-            return _children;
+            for (auto it = _listing.upper_bound(after); it != _listing.end(); ++it) {
+                if (!visit(it->second)) break;
+            }
+        }
+
+        bool dir_t::empty() const {
+            return _children.empty();
+        }
+
+        void dir_t::add_child(const entry_ref& entry) {
+            // Key of a replaced entry points to its own name, which is freed
+            // along with it
+            auto it = _children.find(&entry->name());
+
+            if (it != _children.end()) {
+                entry_ref old_entry(it->second);
+
+                _children.erase(it);
+                _listing.erase(old_entry->ino());
+            }
+
+            _children[&entry->name()] = entry.get();
+            _listing[entry->ino()] = entry;
+        }
+
+        void dir_t::remove_child(const entry_t* entry) {
+            _children.erase(&entry->name());
+            _listing.erase(entry->ino());
         }
 
         int dir_t::find(const string& path, entry_ref& entry, int filter) const {
@@ -34,41 +75,46 @@ namespace vram {
             if ((filter & type::all) == 0) return -ENOENT;
 
             // Traverse file system by hierarchically, starting from this entry
-            entry = std::const_pointer_cast<entry_t>(shared_from_this());
+            entry = entry_ref(const_cast<dir_t*>(this));
 
-            std::stringstream stream(path.substr(1));
+            // Components are copied into the same string, so that short
+            // names don't need any allocations
             string part;
 
             // If the path is empty, assume the root directory
-            while (getline(stream, part, '/')) {
+            for (size_t start = 1; start < path.size();) {
+                size_t end = path.find('/', start);
+                if (end == string::npos) end = path.size();
+
+                part.assign(path, start, end - start);
+                start = end + 1;
+
                 // If current entry isn't a directory, abort
                 if (entry->type() != type::dir) return -ENOTDIR;
 
                 // Navigate to next entry
-                auto dir = std::dynamic_pointer_cast<dir_t>(entry);
-                auto it = dir->_children.find(part);
+                auto dir = static_cast<dir_ptr>(entry.get());
+                auto it = dir->_children.find(&part);
 
                 if (it != dir->_children.end()) {
-                    entry = it->second;
+                    entry = entry_ref(it->second);
                 } else {
                     return -ENOENT;
                 }
             }
 
-            // If an undesired type of entry was found, return an appropriate error
-            if (!(entry->type() & filter)) {
-                if (entry->type() == type::file) {
-                    if (filter & type::symlink) return -ENOENT;
-                    if (filter & type::dir) return -EISDIR;
-                } else if (entry->type() == entry::type::dir) {
-                    if (filter & type::file) return -ENOTDIR;
-                    if (filter & type::symlink) return -EPERM;
-                } else {
-                    return -EPERM;
-                }
-            }
+            return check_type(entry, filter);
+        }
+
+        int dir_t::child(const string& name, entry_ref& entry, int filter) const {
+            if ((filter & type::all) == 0) return -ENOENT;
+
+            auto it = _children.find(&name);
+            if (it == _children.end()) return -ENOENT;
+
+            entry = entry_ref(it->second);
 
-            return 0;
+            return check_type(entry, filter);
         }
     }
 }
@@ -1,16 +1,93 @@
 #include "entry.hpp"
 #include "util.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <sys/xattr.h>
+
 namespace vram {
     namespace entry {
-        int entry_count = 0;
+        std::atomic<int> entry_count(0);
+
+        // The root directory is created first and gets number 1
+        std::atomic<uint64_t> next_ino(1);
+
+        // Entries are allocated in steps of arena_align bytes from slabs of
+        // arena_slab_size bytes, with a separate slab and free list for each
+        // size. Freed entries are reused by the next entry of the same size, the
+        // slabs themselves are kept for the lifetime of the program.
+        const size_t arena_slab_size = 64 * 1024;
+        const size_t arena_align = 16;
+        const size_t arena_max_size = 1024;
+
+        struct free_entry {
+            free_entry* next;
+        };
+
+        struct arena_class {
+            free_entry* free = nullptr;
+            char* next = nullptr;
+            size_t left = 0;
+        };
+
+        std::mutex arena_mutex;
+        arena_class arena_classes[arena_max_size / arena_align];
+
+        // Attributes of entries share a small set of locks
+        const size_t attr_mutex_count = 64;
+        std::mutex attr_mutexes[attr_mutex_count];
+
+        // Names and values of the extended attributes of an entry may take up
+        // at most this many bytes together
+        const size_t xattr_max_size = 64 * 1024;
 
         int count() {
             return entry_count;
         }
 
-        entry_t::entry_t() {
-            auto t = util::time();
+        void* entry_t::operator new(size_t size) {
+            size = (size + arena_align - 1) / arena_align * arena_align;
+            if (size > arena_max_size) return ::operator new(size);
+
+            std::lock_guard<std::mutex> local_lock(arena_mutex);
+
+            auto& cls = arena_classes[size / arena_align - 1];
+
+            if (cls.free) {
+                auto entry = cls.free;
+                cls.free = entry->next;
+                return entry;
+            }
+
+            // Rest of the previous slab is too small, start a new one
+            if (cls.left < size) {
+                cls.next = static_cast<char*>(::operator new(arena_slab_size));
+                cls.left = arena_slab_size;
+            }
+
+            void* ptr = cls.next;
+            cls.next += size;
+            cls.left -= size;
+
+            return ptr;
+        }
+
+        void entry_t::operator delete(void* ptr, size_t size) {
+            size = (size + arena_align - 1) / arena_align * arena_align;
+            if (size > arena_max_size) return ::operator delete(ptr);
+
+            std::lock_guard<std::mutex> local_lock(arena_mutex);
+
+            auto& cls = arena_classes[size / arena_align - 1];
+
+            auto entry = static_cast<free_entry*>(ptr);
+            entry->next = cls.free;
+            cls.free = entry;
+        }
+
+        entry_t::entry_t() : _ino(next_ino++) {
+            auto t = util::to_nanoseconds(util::time());
 
             _atime = t;
             _mtime = t;
@@ -23,12 +100,16 @@ namespace vram {
             entry_count--;
         }
 
+        std::mutex& entry_t::attr_mutex() const {
+            return attr_mutexes[_ino % attr_mutex_count];
+        }
+
         void entry_t::link(dir_ptr parent, const string& name) {
             _parent = parent;
             _name = name;
 
             if (parent) {
-                parent->_children[name] = shared_from_this();
+                parent->add_child(entry_ref(this));
                 parent->mtime(util::time());
             }
         }
@@ -41,69 +122,150 @@ namespace vram {
             return _name;
         }
 
+        uint64_t entry_t::ino() const {
+            return _ino;
+        }
+
         timespec entry_t::atime() const {
-            return _atime;
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+            return util::to_timespec(_atime);
         }
 
         timespec entry_t::mtime() const {
-            return _mtime;
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+            return util::to_timespec(_mtime);
         }
 
         timespec entry_t::ctime() const {
-            return _ctime;
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+            return util::to_timespec(_ctime);
         }
 
         mode_t entry_t::mode() const {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
             return _mode;
         }
 
         uid_t entry_t::user() const {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
             return _user;
         }
 
         gid_t entry_t::group() const {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
             return _group;
         }
 
         void entry_t::atime(timespec t) {
-            _atime = t;
-            ctime(util::time());
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+            _atime = util::to_nanoseconds(t);
+            _ctime = util::to_nanoseconds(util::time());
         }
 
         void entry_t::mtime(timespec t) {
-            _mtime = t;
-            ctime(util::time());
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+            _mtime = util::to_nanoseconds(t);
+            _ctime = util::to_nanoseconds(util::time());
         }
 
         void entry_t::ctime(timespec t) {
-            _ctime = t;
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+            _ctime = util::to_nanoseconds(t);
         }
 
         void entry_t::mode(mode_t mode) {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
             _mode = mode;
-            ctime(util::time());
+            _ctime = util::to_nanoseconds(util::time());
         }
 
         void entry_t::user(uid_t user) {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
             _user = user;
-            ctime(util::time());
+            _ctime = util::to_nanoseconds(util::time());
         }
 
         void entry_t::group(gid_t group) {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
             _group = group;
-            ctime(util::time());
+            _ctime = util::to_nanoseconds(util::time());
+        }
+
+        int entry_t::xattr(const string& name, string& value) const {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+
+            if (!_xattrs) return -ENODATA;
+
+            auto it = _xattrs->find(name);
+            if (it == _xattrs->end()) return -ENODATA;
+
+            value = it->second;
+
+            return 0;
+        }
+
+        int entry_t::xattr(const string& name, const string& value, int flags) {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+
+            bool exists = _xattrs && _xattrs->count(name);
+
+            if (exists && (flags & XATTR_CREATE)) return -EEXIST;
+            if (!exists && (flags & XATTR_REPLACE)) return -ENODATA;
+
+            size_t total = name.size() + value.size();
+            if (_xattrs) {
+                for (auto& attr : *_xattrs) {
+                    if (attr.first != name) total += attr.first.size() + attr.second.size();
+                }
+            }
+            if (total > xattr_max_size) return -ENOSPC;
+
+            // Only allocated once there is something to store, so failed
+            // attempts don't leave an empty map behind
+            if (!_xattrs) _xattrs.reset(new std::map<string, string>());
+
+            (*_xattrs)[name] = value;
+            _ctime = util::to_nanoseconds(util::time());
+
+            return 0;
+        }
+
+        int entry_t::remove_xattr(const string& name) {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+
+            if (!_xattrs || _xattrs->erase(name) == 0) return -ENODATA;
+            if (_xattrs->empty()) _xattrs.reset();
+
+            _ctime = util::to_nanoseconds(util::time());
+
+            return 0;
+        }
+
+        string entry_t::xattr_names() const {
+            std::lock_guard<std::mutex> local_lock(attr_mutex());
+
+            string names;
+
+            if (_xattrs) {
+                for (auto& attr : *_xattrs) {
+                    names += attr.first;
+                    names += '\0';
+                }
+            }
+
+            return names;
         }
 
         void entry_t::unlink() {
             if (_parent) {
-                _parent->_children.erase(_name);
+                _parent->remove_child(this);
                 _parent->mtime(util::time());
             }
         }
 
         void entry_t::move(dir_ptr new_parent, const string& new_name) {
             if (_parent) {
-                _parent->_children.erase(_name);
+                _parent->remove_child(this);
                 _parent->mtime(util::time());
             }
 
@@ -112,7 +274,7 @@ namespace vram {
 
             ctime(util::time());
 
-            new_parent->_children[new_name] = shared_from_this();
+            new_parent->add_child(entry_ref(this));
             new_parent->mtime(util::time());
         }
     }
@@ -1,15 +1,141 @@
 #include "entry.hpp"
+#include "stats.hpp"
 #include "util.hpp"
 
+#include <algorithm>
+#include <cstdint>
+#include <unistd.h>
+
 namespace vram {
     namespace entry {
+        // Files with all of their data within this many bytes are kept in
+        // host memory instead of taking up a block
+        const size_t inline_size = 1024;
+
+        // Position of the block that contains an offset within a file
+        struct block_pos {
+            size_t index;
+            off_t start;
+            size_t size;
+            int cls;
+        };
+
+        // Files start out with blocks of the default class and switch to the
+        // next class once they grow beyond its size, so large files use few
+        // large blocks while small files don't waste much space. The layout
+        // only depends on the offset, so blocks are found in constant time.
+        static block_pos locate_block(off_t off) {
+            int cls = memory::default_class();
+            size_t index = 0;
+            off_t region_start = 0;
+
+            while (cls + 1 < memory::class_count && (size_t) off >= memory::class_size(cls + 1)) {
+                off_t region_end = memory::class_size(cls + 1);
+                index += (region_end - region_start) / memory::class_size(cls);
+                region_start = region_end;
+                cls++;
+            }
+
+            size_t size = memory::class_size(cls);
+            index += (off - region_start) / size;
+
+            return {index, (off_t) ((off / size) * size), size, cls};
+        }
+
+        // Inverse of locate_block(), position of the block with the specified number
+        static block_pos locate_index(size_t index) {
+            int cls = memory::default_class();
+            size_t remaining = index;
+            off_t region_start = 0;
+
+            while (cls + 1 < memory::class_count) {
+                off_t region_end = memory::class_size(cls + 1);
+                size_t region_blocks = (region_end - region_start) / memory::class_size(cls);
+                if (remaining < region_blocks) break;
+
+                remaining -= region_blocks;
+                region_start = region_end;
+                cls++;
+            }
+
+            size_t size = memory::class_size(cls);
+
+            return {index, (off_t) (region_start + remaining * size), size, cls};
+        }
+
+        // The array grows as long as it stays within this many times the
+        // number of blocks (or this many entries for small files)
+        const size_t dense_factor = 4;
+        const size_t dense_minimum = 1024;
+
+        const memory::block_ref& file_t::block_table::get(size_t index) const {
+            static const memory::block_ref none;
+
+            if (index < dense.size()) return dense[index];
+            if (sparse.empty()) return none;
+
+            auto it = sparse.find(index);
+            return it != sparse.end() ? it->second : none;
+        }
+
+        void file_t::block_table::set(size_t index, const memory::block_ref& block) {
+            if (index < dense.size()) {
+                count += (bool) block - (bool) dense[index];
+                dense[index] = block;
+                return;
+            }
+
+            if (!block) {
+                count -= sparse.erase(index);
+                return;
+            }
+
+            if (index >= std::max(dense_minimum, dense_factor * (count + 1))) {
+                auto& slot = sparse[index];
+                if (!slot) count++;
+                slot = block;
+                return;
+            }
+
+            // Blocks of the map that now fall within the array move into it
+            dense.resize(index + 1);
+
+            while (!sparse.empty() && sparse.begin()->first < dense.size()) {
+                dense[sparse.begin()->first] = std::move(sparse.begin()->second);
+                sparse.erase(sparse.begin());
+            }
+
+            dense[index] = block;
+            count++;
+        }
+
+        void file_t::block_table::truncate(size_t index) {
+            sparse.erase(sparse.lower_bound(index), sparse.end());
+
+            if (index < dense.size()) {
+                dense.resize(index);
+            }
+
+            count = sparse.size();
+            for (auto& block : dense) count += (bool) block;
+        }
+
+        size_t file_t::block_table::next(size_t index) const {
+            for (; index < dense.size(); index++) {
+                if (dense[index]) return index;
+            }
+
+            auto it = sparse.lower_bound(index);
+            return it != sparse.end() ? it->first : SIZE_MAX;
+        }
+
         file_ref file_t::make(dir_ptr parent, const string& name) {
             auto file = file_ref(new file_t());
             file->link(parent, name);
             return file;
         }
 
-        file_t::file_t() {
+        file_t::file_t() : queue(memory::next_queue()) {
             mode(0644);
         }
 
@@ -18,130 +144,739 @@ namespace vram {
         }
 
         size_t file_t::size() const {
+            util::shared_lock local_lock(file_lock);
             return _size;
         }
 
-        void file_t::size(size_t new_size) {
+        int file_t::size(size_t new_size) {
+            std::lock_guard<util::rwlock> local_lock(file_lock);
+
+            flush_write_back();
+            written_hash = written_hash_t();
+
+            if (inline_data && new_size < inline_size) {
+                memset(inline_data.get() + new_size, 0, inline_size - new_size);
+                if (new_size == 0) inline_data.reset();
+            }
+
             if (new_size < _size) {
+                // The rest of the last block may be exposed again by growing the
+                // file later, so it can't keep the old data
+                auto pos = locate_block(new_size);
+                off_t block_off = new_size - pos.start;
+
+                if (block_off > 0 && get_block(pos.index)) {
+                    int err = zero_block(pos.index, pos.cls, block_off, pos.size - block_off);
+                    if (err) return err;
+                }
+
                 free_blocks(new_size);
             }
 
             _size = new_size;
 
             mtime(util::time());
+
+            return 0;
+        }
+
+        int file_t::read(off_t off, size_t size, char* data) {
+            while (true) {
+                {
+                    util::shared_lock local_lock(file_lock);
+
+                    if (!write_back.block) {
+                        return read_blocks(off, size, data);
+                    }
+                }
+
+                // Collected writes need to reach the block before it can be
+                // read, which requires exclusive access
+                std::lock_guard<util::rwlock> local_lock(file_lock);
+                flush_write_back();
+            }
         }
 
-        int file_t::read(off_t off, size_t size, char* data, std::mutex& wait_mutex) {
+        int file_t::read_blocks(off_t off, size_t size, char* data) {
             if ((size_t) off >= _size) return 0;
             size = std::min(_size - off, size);
 
-            // Walk over blocks in read region
+            if (inline_data) {
+                size_t inline_read = (size_t) off < inline_size ? std::min(inline_size - off, size) : 0;
+
+                memcpy(data, inline_data.get() + off, inline_read);
+                memset(data + inline_read, 0, size - inline_read);
+
+                atime(util::time());
+
+                return size;
+            }
+
+            // Walk over blocks in read region, the transfers are issued at once
+            // and only waited for at the end
             off_t end_pos = off + size;
             size_t total_read = size;
+            memory::transfer_batch batch;
 
             while (off < end_pos) {
                 // Find block corresponding to current offset
-                off_t block_start = (off / memory::block::size) * memory::block::size;
-                off_t block_off = off - block_start;
-                size_t read_size = std::min(memory::block::size - block_off, size);
+                auto pos = locate_block(off);
+
+                off_t block_off = off - pos.start;
+                size_t read_size = std::min(pos.size - block_off, size);
 
-                auto block = get_block(block_start);
+                auto& block = get_block(pos.index);
 
-                // Allow multiple threads to block for reading simultaneously
-                wait_mutex.unlock();
                 if (block) {
-                    block->read(block_off, read_size, data);
+                    block->read(block_off, read_size, data, batch);
                 } else {
                     // Non-written part of file
                     memset(data, 0, read_size);
                 }
-                wait_mutex.lock();
 
                 data += read_size;
                 off += read_size;
                 size -= read_size;
             }
 
+            batch.wait();
+
             atime(util::time());
 
             return total_read;
         }
 
+        void file_t::prefetch(off_t off, size_t size) const {
+            util::shared_lock local_lock(file_lock);
+
+            off_t end_pos = std::min((size_t) off + size, _size);
+
+            while (off < end_pos) {
+                auto pos = locate_block(off);
+
+                off_t block_off = off - pos.start;
+                size_t prefetch_size = std::min(pos.size - block_off, (size_t) (end_pos - off));
+
+                auto& block = get_block(pos.index);
+                if (block) block->prefetch(block_off, prefetch_size);
+
+                off += prefetch_size;
+            }
+        }
+
         int file_t::write(off_t off, size_t size, const char* data, bool async) {
-            // Walk over blocks in write region
+            std::lock_guard<util::rwlock> local_lock(file_lock);
+            return write_blocks(off, size, data, nullptr, async);
+        }
+
+        int file_t::write(off_t off, size_t size, const write_source& source) {
+            std::lock_guard<util::rwlock> local_lock(file_lock);
+            return write_blocks(off, size, nullptr, &source, true);
+        }
+
+        int file_t::write_blocks(off_t off, size_t size, const char* data, const write_source* source, bool async) {
+            if (size > 0 && file_blocks.empty() && (size_t) off + size <= inline_size) {
+                if (!inline_data) inline_data.reset(new char[inline_size]());
+
+                char* dst = inline_data.get() + off;
+
+                if (!source) {
+                    memcpy(dst, data, size);
+                } else if (!(*source)(dst, size)) {
+                    // Keep everything beyond the end of the file zero
+                    if ((size_t) off + size > _size) {
+                        size_t keep = std::max(_size, (size_t) off) - off;
+                        memset(dst + keep, 0, size - keep);
+                    }
+
+                    return -EIO;
+                }
+
+                _size = std::max(_size, (size_t) off + size);
+                mtime(util::time());
+
+                return size;
+            }
+
+            int err = move_inline();
+            if (err) return err;
+
+            // Walk over blocks in write region, synchronous writes are only
+            // waited for at the end
             off_t end_pos = off + size;
             size_t total_write = size;
+            memory::transfer_batch batch;
+            bool source_failed = false;
+
+            // Take the next part of the data
+            auto fill = [&](char* dst, size_t fill_size) {
+                if (source) {
+                    source_failed = !(*source)(dst, fill_size);
+                } else {
+                    memcpy(dst, data, fill_size);
+                }
+            };
+
+            auto advance = [&](size_t write_size) {
+                if (data) data += write_size;
+                off += write_size;
+                size -= write_size;
+            };
 
             while (off < end_pos) {
                 // Find block corresponding to current offset
-                off_t block_start = (off / memory::block::size) * memory::block::size;
-                off_t block_off = off - block_start;
-                size_t write_size = std::min(memory::block::size - block_off, size);
+                auto pos = locate_block(off);
+
+                size_t block_size = pos.size;
+                off_t block_off = off - pos.start;
+                size_t write_size = std::min(block_size - block_off, size);
+
+                auto& wb = write_back;
+                bool appends = wb.block && wb.block_index == pos.index && wb.end == block_off &&
+                    (size_t) (wb.end - wb.begin) + write_size <= memory::staging_size;
+
+                if (async && appends) {
+                    // Continues the collected writes
+                    fill(wb.staging->data + (block_off - wb.begin), write_size);
+                    if (source_failed) break;
+
+                    wb.end += write_size;
+
+                    bool hashed = hash_written(pos.index, block_off, wb.staging->data + (block_off - wb.begin), write_size, block_size);
+
+                    if ((size_t) wb.end == block_size || (size_t) (wb.end - wb.begin) == memory::staging_size) {
+                        flush_write_back();
+                    }
+
+                    if (hashed) share_written(pos.index, pos.cls);
+                } else {
+                    flush_write_back();
+
+                    // Start collecting if more sequential writes to this block
+                    // can follow, otherwise (or if no staging buffer is free)
+                    // transfer right away. Data from a source always goes
+                    // through a staging buffer if possible.
+                    bool collect = async && block_off + write_size < block_size && write_size < memory::staging_size;
+
+                    memory::staging_ref staging;
+                    if (collect || (source && write_size <= memory::staging_size)) {
+                        staging = memory::acquire_staging();
+                    }
+
+                    if (staging) {
+                        fill(staging->data, write_size);
+                        if (source_failed) break;
+                    }
 
-                auto block = get_block(block_start);
+                    // Zeros written to a hole don't need to be stored, and
+                    // blocks that are overwritten with them become holes
+                    const char* contents = staging ? staging->data : data;
+                    bool hashed = hash_written(pos.index, block_off, contents, write_size, block_size);
+                    bool hole = !get_block(pos.index) || write_size == block_size;
 
-                if (!block) {
-                    block = alloc_block(block_start);
+                    if (contents && hole && util::is_zero(contents, write_size)) {
+                        file_blocks.set(pos.index, nullptr);
+
+                        stats::add(stats::counter::bytes_zero, write_size);
+
+                        advance(write_size);
+                        continue;
+                    }
+
+                    // Blocks that are written entirely at once are shared with
+                    // other blocks of the same class that have the same contents
+                    // before they're transferred, others once they're complete
+                    bool dedup = hashed && write_size == block_size;
+                    util::hash128 contents_hash;
+
+                    if (dedup) {
+                        contents_hash = written_hash.hasher.result();
+                        written_hash = written_hash_t();
+
+                        auto found = memory::find_block(pos.cls, contents_hash, contents);
+
+                        if (found) {
+                            file_blocks.set(pos.index, found);
+                            pending_writes.add(*found);
+
+                            stats::add(stats::counter::bytes_deduplicated, write_size);
+
+                            advance(write_size);
+                            continue;
+                        }
+                    }
+
+                    // Shared blocks are copied first, unless they're overwritten entirely
+                    auto block = writable_block(pos.index, pos.cls, write_size != block_size);
 
                     // Failed to allocate buffer, likely out of VRAM
                     if (!block) break;
-                }
 
-                block->write(block_off, write_size, data, async);
-
-                last_written_block = block;
+                    if (staging && collect) {
+                        wb.block = block;
+                        wb.block_index = pos.index;
+                        wb.staging = std::move(staging);
+                        wb.begin = block_off;
+                        wb.end = block_off + write_size;
+                    } else {
+                        if (staging) {
+                            block->write(block_off, write_size, std::move(staging));
+                        } else if (source) {
+                            std::unique_ptr<char[]> copy(new char[write_size]);
+                            fill(copy.get(), write_size);
+                            if (source_failed) break;
+
+                            block->write(block_off, write_size, copy.get(), true);
+                        } else if (async) {
+                            block->write(block_off, write_size, data, true);
+                        } else {
+                            block->write(block_off, write_size, data, batch);
+                        }
+
+                        pending_writes.add(*block);
+
+                        if (dedup) {
+                            block->publish(contents_hash);
+                        } else if (hashed) {
+                            share_written(pos.index, pos.cls);
+                        }
+                    }
+                }
 
-                data += write_size;
-                off += write_size;
-                size -= write_size;
+                advance(write_size);
             }
 
+            batch.wait();
+
             if (_size < (size_t) off) {
                 _size = off;
             }
             mtime(util::time());
 
-            if (off < end_pos) {
+            if (source_failed) {
+                return -EIO;
+            } else if (off < end_pos) {
                 return -ENOSPC;
             } else {
                 return total_write;
             }
         }
 
+        int file_t::preallocate(off_t off, size_t size, bool keep_size) {
+            std::lock_guard<util::rwlock> local_lock(file_lock);
+            return allocate_blocks(off, size, false, keep_size);
+        }
+
+        int file_t::zero_range(off_t off, size_t size, bool keep_size) {
+            std::lock_guard<util::rwlock> local_lock(file_lock);
+            return allocate_blocks(off, size, true, keep_size);
+        }
+
+        int file_t::allocate_blocks(off_t off, size_t size, bool zero, bool keep_size) {
+            flush_write_back();
+            written_hash = written_hash_t();
+
+            int err = move_inline();
+            if (err) return err;
+
+            off_t end_pos = off + size;
+
+            while (off < end_pos) {
+                auto pos = locate_block(off);
+
+                off_t block_off = off - pos.start;
+                size_t part_size = std::min(pos.size - block_off, (size_t) (end_pos - off));
+
+                if (!get_block(pos.index)) {
+                    // New blocks read as zeros until they're written to
+                    if (!alloc_block(pos.index, pos.cls)) {
+                        err = -ENOSPC;
+                        break;
+                    }
+                } else if (zero) {
+                    err = zero_block(pos.index, pos.cls, block_off, part_size);
+                    if (err) break;
+                }
+
+                off += part_size;
+            }
+
+            if (!keep_size && _size < (size_t) off) {
+                _size = off;
+            }
+            if (zero) mtime(util::time());
+
+            return err;
+        }
+
+        int file_t::punch_hole(off_t off, size_t size) {
+            std::lock_guard<util::rwlock> local_lock(file_lock);
+
+            flush_write_back();
+            written_hash = written_hash_t();
+
+            if (inline_data) {
+                if ((size_t) off < inline_size) {
+                    memset(inline_data.get() + off, 0, std::min(inline_size - off, size));
+                }
+
+                mtime(util::time());
+
+                return 0;
+            }
+
+            off_t end_pos = off + size;
+            int err = 0;
+
+            while (off < end_pos) {
+                auto pos = locate_block(off);
+
+                // Holes are skipped up to the next block
+                size_t next = file_blocks.next(pos.index);
+                if (next == SIZE_MAX) break;
+
+                if (next != pos.index) {
+                    off = locate_index(next).start;
+                    continue;
+                }
+
+                off_t block_off = off - pos.start;
+                size_t part_size = std::min(pos.size - block_off, (size_t) (end_pos - off));
+
+                if (part_size == pos.size) {
+                    file_blocks.set(pos.index, nullptr);
+                } else {
+                    err = zero_block(pos.index, pos.cls, block_off, part_size);
+                    if (err) break;
+                }
+
+                off += part_size;
+            }
+
+            mtime(util::time());
+
+            return err;
+        }
+
+        int file_t::copy(off_t off, size_t size, file_t& src, off_t src_off) {
+            if (&src == this) {
+                std::lock_guard<util::rwlock> local_lock(file_lock);
+                return copy_blocks(off, size, src, src_off);
+            }
+
+            // Locks are taken in address order, so that copies in opposite
+            // directions can't deadlock
+            file_t* first = std::min(this, &src);
+            file_t* second = std::max(this, &src);
+
+            std::lock_guard<util::rwlock> first_lock(first->file_lock);
+            std::lock_guard<util::rwlock> second_lock(second->file_lock);
+
+            return copy_blocks(off, size, src, src_off);
+        }
+
+        int file_t::copy_blocks(off_t off, size_t size, file_t& src, off_t src_off) {
+            flush_write_back();
+            src.flush_write_back();
+            written_hash = written_hash_t();
+
+            if ((size_t) src_off >= src._size) return 0;
+            size = std::min(src._size - src_off, size);
+
+            // Inline data is copied through the host like any other write,
+            // the source may be this file itself
+            if (src.inline_data && (size_t) src_off + size <= inline_size) {
+                std::unique_ptr<char[]> copy(new char[size]);
+                memcpy(copy.get(), src.inline_data.get() + src_off, size);
+
+                return write_blocks(off, size, copy.get(), nullptr, true);
+            }
+
+            int err = move_inline();
+            if (!err) err = src.move_inline();
+            if (err) return err;
+
+            off_t end_pos = off + size;
+
+            while (off < end_pos) {
+                // The layouts of both files are walked at the same time, each
+                // step stays within a block of both
+                auto pos = locate_block(off);
+                auto src_pos = locate_block(src_off);
+
+                off_t block_off = off - pos.start;
+                off_t src_block_off = src_off - src_pos.start;
+                size_t copy_size = std::min({pos.size - block_off, src_pos.size - src_block_off, (size_t) (end_pos - off)});
+
+                // Copied by value, since resizing the block array of this file
+                // may move it
+                memory::block_ref src_block = src.get_block(src_pos.index);
+
+                if (!src_block && !get_block(pos.index)) {
+                    // Holes in both files are skipped up to the next block of either one
+                    size_t skip = end_pos - off;
+
+                    size_t next = file_blocks.next(pos.index);
+                    if (next != SIZE_MAX) skip = std::min(skip, (size_t) (locate_index(next).start - off));
+
+                    size_t src_next = src.file_blocks.next(src_pos.index);
+                    if (src_next != SIZE_MAX) skip = std::min(skip, (size_t) (locate_index(src_next).start - src_off));
+
+                    copy_size = std::max(copy_size, skip);
+                } else if (copy_size == pos.size && src_block_off == 0 && src_pos.size == pos.size) {
+                    // Whole blocks are shared until either file writes to them
+                    if (src_block) pending_writes.add(*src_block);
+
+                    file_blocks.set(pos.index, src_block);
+                } else if (!src_block) {
+                    // Holes are copied by clearing
+                    err = zero_block(pos.index, pos.cls, block_off, copy_size);
+                    if (err) break;
+                } else {
+                    auto block = writable_block(pos.index, pos.cls, copy_size != pos.size);
+
+                    if (!block) {
+                        err = -ENOSPC;
+                        break;
+                    }
+
+                    block->copy(block_off, copy_size, *src_block, src_block_off);
+                    pending_writes.add(*block);
+                }
+
+                off += copy_size;
+                src_off += copy_size;
+            }
+
+            int total_copy = size - (end_pos - off);
+
+            if (_size < (size_t) off) {
+                _size = off;
+            }
+            mtime(util::time());
+
+            return total_copy > 0 ? total_copy : err;
+        }
+
+        file_ref file_t::clone() {
+            std::lock_guard<util::rwlock> local_lock(file_lock);
+
+            flush_write_back();
+
+            // Partial blocks at the end can be shared as well, since anything
+            // beyond the end of a file is zero
+            auto copy = make(nullptr, name());
+            copy->file_blocks = file_blocks;
+            copy->pending_writes = pending_writes;
+            copy->_size = _size;
+
+            if (inline_data) {
+                copy->inline_data.reset(new char[inline_size]);
+                memcpy(copy->inline_data.get(), inline_data.get(), inline_size);
+            }
+
+            return copy;
+        }
+
+        off_t file_t::seek(off_t off, int whence) const {
+            util::shared_lock local_lock(file_lock);
+
+            if (off < 0 || (size_t) off >= _size) return -ENXIO;
+
+            bool data = whence == SEEK_DATA;
+
+            // All of the inline data counts as data, the rest as a hole
+            if (inline_data) {
+                size_t data_end = std::min(_size, inline_size);
+
+                if ((size_t) off < data_end) {
+                    return data ? off : data_end;
+                } else {
+                    return data ? -ENXIO : off;
+                }
+            }
+
+            // Blocks are only checked for existence, collected writes belong
+            // to an allocated block already
+            while ((size_t) off < _size) {
+                auto pos = locate_block(off);
+
+                // Nothing but holes beyond the last block
+                size_t next = file_blocks.next(pos.index);
+
+                if (next == SIZE_MAX) {
+                    return data ? -ENXIO : off;
+                }
+
+                if ((next == pos.index) == data) {
+                    return off;
+                }
+
+                // Holes are skipped up to the next block
+                off = data ? locate_index(next).start : pos.start + pos.size;
+            }
+
+            return data ? -ENXIO : _size;
+        }
+
+        void file_t::flush() {
+            std::lock_guard<util::rwlock> local_lock(file_lock);
+            flush_write_back();
+        }
+
         void file_t::sync() {
-            // Waits for all asynchronous writes to finish, because they must
-            // complete before the last write does (OpenCL guarantee)
-            last_written_block->sync();
+            flushed_writes().wait();
+        }
+
+        void file_t::sync(const std::function<void()>& done) {
+            flushed_writes().wait(done);
+        }
+
+        memory::write_set file_t::flushed_writes() {
+            std::lock_guard<util::rwlock> local_lock(file_lock);
+
+            flush_write_back();
+
+            // Waited for without the lock, so writes can continue meanwhile
+            return pending_writes;
+        }
+
+        void file_t::flush_write_back() {
+            if (!write_back.block) return;
+
+            auto& wb = write_back;
+            wb.block->write(wb.begin, wb.end - wb.begin, std::move(wb.staging));
+
+            pending_writes.add(*wb.block);
+            wb.block = nullptr;
+        }
+
+        bool file_t::hash_written(size_t index, off_t offset, const char* data, size_t size, size_t block_size) {
+            if (!memory::dedup_enabled()) return false;
+
+            auto& wh = written_hash;
+
+            if (!data || (offset != 0 && (index != wh.block_index || offset != wh.end))) {
+                // Changes elsewhere in the hashed block make its hash useless,
+                // while those of other blocks don't matter
+                if (index == wh.block_index) wh = written_hash_t();
+                return false;
+            } else if (offset == 0) {
+                wh = written_hash_t();
+                wh.block_index = index;
+            }
+
+            wh.hasher.add(data, size);
+            wh.end += size;
+
+            return (size_t) wh.end == block_size;
         }
 
-        memory::block_ref file_t::get_block(off_t off) const {
-            auto it = file_blocks.find(off);
+        void file_t::share_written(size_t index, int cls) {
+            auto contents = written_hash.hasher.result();
+            written_hash = written_hash_t();
+
+            // Kept alive here, since it's replaced if another block is found
+            memory::block_ref block = get_block(index);
+            if (!block) return;
+
+            // Its data is on the device by now, so it's only read back if
+            // there is a block with the same hash to compare it with
+            auto found = memory::find_block(cls, contents, *block);
 
-            if (it != file_blocks.end()) {
-                return it->second;
+            if (found) {
+                file_blocks.set(index, found);
+                pending_writes.add(*found);
+
+                stats::add(stats::counter::bytes_deduplicated, block->size());
             } else {
-                return nullptr;
+                block->publish(contents);
+            }
+        }
+
+        int file_t::move_inline() {
+            if (!inline_data) return 0;
+
+            // Files that only hold zeros become a hole
+            size_t used = std::min(_size, inline_size);
+
+            if (!util::is_zero(inline_data.get(), used)) {
+                auto pos = locate_block(0);
+
+                auto& block = alloc_block(pos.index, pos.cls);
+                if (!block) return -ENOSPC;
+
+                block->write(0, used, inline_data.get(), true);
+                pending_writes.add(*block);
             }
+
+            inline_data.reset();
+
+            return 0;
+        }
+
+        const memory::block_ref& file_t::get_block(size_t index) const {
+            return file_blocks.get(index);
         }
 
-        memory::block_ref file_t::alloc_block(off_t off) {
-            auto block = memory::allocate();
+        const memory::block_ref& file_t::alloc_block(size_t index, int cls) {
+            // Consecutive blocks are striped over the devices, starting at a
+            // different one for each queue
+            file_blocks.set(index, memory::allocate(cls, queue, queue + index));
 
-            if (block) {
-                file_blocks[off] = block;
+            return file_blocks.get(index);
+        }
+
+        bool file_t::is_shared(const memory::block_ref& block) const {
+            // The only reference of this file is in the block array, since
+            // collected writes are always flushed first
+            return block.use_count() > 1;
+        }
+
+        memory::block_ref file_t::writable_block(size_t index, int cls, bool keep_data) {
+            auto& current = get_block(index);
+
+            if (!current) return alloc_block(index, cls);
+
+            // Published blocks may be shared by any writer of the same
+            // contents, which is ruled out before changing them in place
+            if (!is_shared(current)) {
+                current->unpublish();
+                if (!is_shared(current)) return current;
+            }
+
+            // Copy on write, the other files keep the original
+            auto block = memory::allocate(cls, queue, queue + index);
+            if (!block) return nullptr;
+
+            if (keep_data) {
+                block->copy(0, block->size(), *current, 0);
+                pending_writes.add(*block);
             }
 
+            file_blocks.set(index, block);
+
             return block;
         }
 
+        int file_t::zero_block(size_t index, int cls, off_t offset, size_t size) {
+            auto block = writable_block(index, cls);
+            if (!block) return -ENOSPC;
+
+            block->zero(offset, size);
+
+            // Clearing counts as a write for sync()
+            pending_writes.add(*block);
+
+            return 0;
+        }
+
         void file_t::free_blocks(off_t off) {
             // Determine first block just beyond the range
-            off_t start_off = (off / memory::block::size) * memory::block::size;
-            if (off % memory::block::size != 0) start_off += memory::block::size;
+            auto pos = locate_block(off);
+            size_t index = pos.start == off ? pos.index : pos.index + 1;
 
-            for (auto it = file_blocks.find(start_off); it != file_blocks.end();) {
-                it = file_blocks.erase(it);
-            }
+            file_blocks.truncate(index);
         }
     }
 }
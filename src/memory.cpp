@@ -1,30 +1,565 @@
 #include "memory.hpp"
+#include "numa.hpp"
+#include "stats.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <unistd.h>
 
 namespace vram {
     namespace memory {
-        // Connection with OpenCL
         bool ready = false;
-        bool has_fillbuffer = false; // supports the FillBuffer API (platform is version 1.2 or higher)
-        cl::Context context;
-        cl::Device device;
-        cl::CommandQueue queue;
 
-        cl::Buffer zero_buffer; // used to clear buffers on pre-1.2 platforms
+        // In-order queues that transfers are spread over, so that a blocking
+        // read only waits for commands of blocks that share its queue
+        const size_t queue_count = 4;
+        std::atomic<size_t> queue_counter(0);
+
+        // Transfers that nobody is waiting for may only have this many bytes in
+        // flight per device, beyond which asynchronous writes wait for earlier
+        // ones to complete and prefetches are dropped, so that they can't build
+        // up a backlog in front of reads
+        struct transfer_budget {
+            std::mutex mutex;
+            std::condition_variable cv;
+            size_t limit;
+            size_t in_flight = 0;
+
+            transfer_budget(size_t limit) : limit(limit) {}
+        };
+
+        transfer_budget write_back_budget(16 * 1024 * 1024);
+        transfer_budget prefetch_budget(4 * 1024 * 1024);
+
+        const size_t class_sizes[class_count] = {
+            4 * 1024,
+            64 * 1024,
+            1024 * 1024,
+            16 * 1024 * 1024
+        };
+
+        const size_t chunk_size = class_sizes[class_count - 1];
+
+        // Chunks are carved out of a few large buffers, because drivers are slow
+        // to create many buffers and some limit how many can exist. The size is
+        // further limited by the largest allocation the device supports.
+        const size_t max_slab_size = 1024 * 1024 * 1024;
+
+        int first_class = 1;
+
+        // Threads and host memory are placed on the NUMA node of the first device
+        bool numa_binding = true;
+        int bound_node = -1;
+
+        // Blocks keep track of which of their pieces have been written to
+        const int block_pieces = 64;
+        const uint64_t all_pieces = ~0ULL;
+
+        // Blocks that were written entirely at once, by the hash of their
+        // contents, each block is in here at most once
+        struct hash128_hash {
+            size_t operator()(const util::hash128& h) const {
+                return h.low;
+            }
+        };
+
+        bool dedup = false;
+        std::mutex dedup_mutex;
+        std::unordered_map<util::hash128, std::weak_ptr<block>, hash128_hash> dedup_index;
+
+        // Pinned host buffers that asynchronous writes are staged in, which
+        // are mapped once and recycled when their transfer has completed
+        const size_t staging_count = 32;
+        std::vector<staging_buffer> staging_buffers;
+
+        std::mutex staging_mutex;
+        std::vector<staging_buffer*> free_staging;
+
+        // Record the queueing and execution time of a completed transfer
+        static void record_transfer(cl_event event) {
+            if (!event) return;
+
+            cl_command_type type;
+            cl_ulong queued, start, end;
+
+            if (clGetEventInfo(event, CL_EVENT_COMMAND_TYPE, sizeof(type), &type, nullptr) != CL_SUCCESS ||
+                clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, nullptr) != CL_SUCCESS ||
+                clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, nullptr) != CL_SUCCESS ||
+                clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, nullptr) != CL_SUCCESS) {
+                return;
+            }
+
+            stats::transfer(type == CL_COMMAND_WRITE_BUFFER, start - queued, end - start);
+        }
+
+        // Host copy of a recently read line of a block, kept coherent with
+        // writes to it (lines are the size of the block for small blocks)
+        const size_t cache_line_size = 128 * 1024;
+        const size_t cache_lines = 256;
+
+        struct cache_entry {
+            std::unique_ptr<char[]> data;
+            cl::Event fill;
+
+            cache_entry(size_t size) : data(new char[size]) {}
+
+            // The transfer into the copy may still be pending
+            ~cache_entry() {
+                fill.wait();
+            }
+        };
+
+        typedef std::pair<const block*, off_t> cache_key;
+
+        struct cache_key_hash {
+            size_t operator()(const cache_key& key) const {
+                return std::hash<const block*>()(key.first) ^ std::hash<off_t>()(key.second);
+            }
+        };
+
+        std::mutex cache_mutex;
+        std::list<cache_key> cache_lru; // most recently used first
+        std::unordered_map<cache_key, std::pair<cache_ref, std::list<cache_key>::iterator>, cache_key_hash> cache;
+
+        // Free block within a chunk with the last write issued to it, which
+        // may still be pending on the queue of its previous owner, and copies
+        // from it on other queues that may still be reading it
+        struct free_slot {
+            off_t offset;
+            cl::Event last_write;
+            std::vector<cl::Event> copies;
+        };
+
+        typedef std::chrono::steady_clock clock;
+
+        struct gpu;
+
+        struct slab {
+            cl::Buffer buffer;
+            size_t chunk_count;
+
+            // Chunks that aren't split into blocks and since when all of them are
+            size_t free_count;
+            clock::time_point idle_since;
+        };
+
+        struct chunk {
+            // Device and slab that the chunk is part of and its offset within it
+            gpu* dev;
+            slab* parent;
+            cl::Buffer buffer;
+            off_t base;
+
+            // Class the chunk is currently split into, or -1 if it's unused
+            int cls = -1;
+            size_t used = 0;
+            std::vector<free_slot> free_slots;
+
+            // Position in the list of chunks with free blocks of its class
+            std::list<chunk*>::iterator partial;
+
+            // Last writes to the chunk while it was split into another class
+            std::vector<cl::Event> retired;
+
+            // Blocks that are stored in the chunk
+            std::vector<block*> blocks;
+
+            // Set whenever one of the blocks is accessed, cleared by the
+            // eviction clock as it passes
+            std::atomic<bool> referenced{false};
+        };
+
+        // Connection with an OpenCL device and the part of the pool that lives
+        // on it, the pool members are protected by pool_mutex
+        struct gpu {
+            size_t index;
+            cl::Device device;
+            cl::Context context;
+            bool has_fillbuffer = false; // supports the FillBuffer API (platform is version 1.2 or higher)
+            std::vector<cl::CommandQueue> queues;
+            std::vector<cl::CommandQueue> read_queues; // for reads that are waited for
+            cl::Buffer zero_buffer; // used to clear buffers on pre-1.2 platforms
+            size_t slab_size = max_slab_size;
+
+            std::vector<std::unique_ptr<slab>> slabs;
+            std::vector<std::unique_ptr<chunk>> chunks;
+            std::vector<chunk*> free_chunks;
+            std::list<chunk*> partial_chunks[class_count];
+
+            bool grow_requested = false;
+            bool growing = false;
+            clock::time_point grow_failed_at;
+
+            // Next chunk that the eviction clock looks at
+            size_t clock_hand = 0;
+        };
+
+        // Devices that blocks are striped over
+        std::vector<size_t> device_nums = {0};
+        std::vector<gpu> gpus;
+
+        // Blocks are allocated and freed by any thread holding a file lock
+        std::mutex pool_mutex;
+        size_t pool_bytes = 0;
+        size_t available_bytes = 0;
+
+        // Growing the pool on demand, a background thread adds a slab to a
+        // device once fewer than *grow_threshold* of its chunks are free, and
+        // allocations wait for it if there are none at all
+        const size_t grow_threshold = 16;
+        const auto grow_retry_delay = std::chrono::seconds(5);
+
+        size_t pool_limit = 0;
+        size_t pool_reserve = 0;
+        std::chrono::seconds release_delay(0);
+
+        std::condition_variable grow_cv; // wakes the background thread
+        std::condition_variable grown_cv; // wakes allocations waiting for memory
+        bool grow_requested = false; // by any of the devices
+
+        // Stops the background thread on exit, before the state above is destroyed
+        struct pool_thread {
+            std::thread thread;
+            bool stop = false;
+
+            ~pool_thread() {
+                if (!thread.joinable()) return;
+
+                {
+                    std::lock_guard<std::mutex> local_lock(pool_mutex);
+                    stop = true;
+                }
+
+                grow_cv.notify_one();
+                thread.join();
+            }
+        } manager;
+
+        /*
+         * Spill tier
+         */
+
+        // Copy of an evicted block, which stays in host memory until the
+        // writer thread has stored it in the spill file
+        struct spill_copy {
+            int cls;
+            std::mutex mutex;
+            std::unique_ptr<char[]> data;
+            cl::Event transfer; // from VRAM into data
+            off_t file_offset = -1;
+
+            spill_copy(int cls) : cls(cls), data(new char[class_sizes[cls]]) {}
+            ~spill_copy();
+        };
+
+        // Unlinked file that evicted blocks are stored in, -1 if disabled
+        int spill_fd = -1;
+
+        // Rounds of eviction, a millisecond apart, before an allocation fails
+        const int evict_attempts = 1000;
+
+        // Slots of the spill file, the file only ever grows, but the space of
+        // free slots is given back to the file system
+        std::mutex spill_mutex;
+        off_t spill_end = 0;
+        std::vector<off_t> spill_slots[class_count];
+
+        // Copies waiting to be written to the file
+        std::condition_variable spill_cv;
+        std::deque<spill_ref> spill_queue;
+
+        // Stops the writer thread on exit, before the state above is destroyed
+        struct spill_thread {
+            std::thread thread;
+            bool stop = false;
+
+            ~spill_thread() {
+                if (!thread.joinable()) return;
+
+                {
+                    std::lock_guard<std::mutex> local_lock(spill_mutex);
+                    stop = true;
+                }
+
+                spill_cv.notify_one();
+                thread.join();
+            }
+        } spill_writer;
+
+        spill_copy::~spill_copy() {
+            if (file_offset < 0) return;
+
+            fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, file_offset, class_sizes[cls]);
+
+            std::lock_guard<std::mutex> local_lock(spill_mutex);
+            spill_slots[cls].push_back(file_offset);
+        }
+
+        // Free slot of the class in the spill file, requires spill_mutex
+        static off_t take_spill_slot(int cls) {
+            if (!spill_slots[cls].empty()) {
+                off_t slot = spill_slots[cls].back();
+                spill_slots[cls].pop_back();
+                return slot;
+            }
+
+            off_t slot = spill_end;
+            spill_end += class_sizes[cls];
+            return slot;
+        }
+
+        static bool write_fully(const char* data, size_t size, off_t offset) {
+            while (size > 0) {
+                ssize_t r = pwrite(spill_fd, data, size, offset);
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) return false;
+
+                data += r;
+                size -= r;
+                offset += r;
+            }
+
+            return true;
+        }
+
+        static bool read_fully(char* data, size_t size, off_t offset) {
+            while (size > 0) {
+                ssize_t r = pread(spill_fd, data, size, offset);
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) return false;
+
+                data += r;
+                size -= r;
+                offset += r;
+            }
+
+            return true;
+        }
+
+        // Body of the writer thread, copies that can't be written (because the
+        // file system is full, for example) simply stay in host memory
+        static void write_spilled() {
+            std::unique_lock<std::mutex> local_lock(spill_mutex);
+
+            while (true) {
+                spill_cv.wait(local_lock, [] { return !spill_queue.empty() || spill_writer.stop; });
+                if (spill_writer.stop) break;
+
+                spill_ref copy = spill_queue.front();
+                spill_queue.pop_front();
+
+                // Nothing to do if the block has been freed already
+                if (copy.use_count() == 1) {
+                    local_lock.unlock();
+                    copy = nullptr;
+                    local_lock.lock();
+                    continue;
+                }
+
+                int cls = copy->cls;
+                off_t slot = take_spill_slot(cls);
+                bool written = false;
+
+                local_lock.unlock();
+
+                {
+                    std::lock_guard<std::mutex> copy_lock(copy->mutex);
+
+                    // Data is taken back if the block was loaded in the meantime
+                    if (copy->data) {
+                        copy->transfer.wait();
+
+                        if (write_fully(copy->data.get(), class_sizes[cls], slot)) {
+                            copy->file_offset = slot;
+                            copy->data = nullptr;
+                            written = true;
+                        }
+                    }
+                }
+
+                // The copy may take the spill lock when it's destroyed
+                copy = nullptr;
+
+                local_lock.lock();
+
+                if (!written) spill_slots[cls].push_back(slot);
+            }
+        }
+
+        bool set_spill_dir(const std::string& dir) {
+            std::string path = dir + "/vramfs-XXXXXX";
+            std::vector<char> name(path.begin(), path.end());
+            name.push_back('\0');
+
+            spill_fd = mkstemp(name.data());
+            if (spill_fd < 0) return false;
+
+            // Only the descriptor keeps it around, so it's gone once vramfs exits
+            unlink(name.data());
+
+            spill_writer.thread = std::thread(write_spilled);
+
+            return true;
+        }
+
+        // Pieces of a block that overlap the region, or only the ones that it
+        // covers entirely if *covered* is set
+        static uint64_t piece_mask(size_t block_size, off_t offset, size_t size, bool covered) {
+            size_t piece = block_size / block_pieces;
+
+            size_t first = covered ? (offset + piece - 1) / piece : offset / piece;
+            size_t end = covered ? (offset + size) / piece : (offset + size + piece - 1) / piece;
+
+            if (first >= end) return 0;
+
+            uint64_t below_end = end == block_pieces ? all_pieces : (1ULL << end) - 1;
+            return below_end & ~((1ULL << first) - 1);
+        }
+
+        // Fill region of buffer with zeros
+        static int clear_buffer(gpu& dev, cl::CommandQueue& queue, cl::Buffer& buf, off_t offset, size_t size,
+                const std::vector<cl::Event>* wait = nullptr, cl::Event* event = nullptr) {
+            if (dev.has_fillbuffer)
+                return queue.enqueueFillBuffer(buf, 0, offset, size, wait, event);
+
+            // The zero buffer is one chunk large, so larger regions are cleared
+            // a piece at a time, the queue completes the last piece last
+            for (size_t done = 0; done < size; done += chunk_size) {
+                size_t piece = std::min(chunk_size, size - done);
+
+                int r = queue.enqueueCopyBuffer(dev.zero_buffer, buf, 0, offset + done, piece, wait, done + piece == size ? event : nullptr);
+                if (r != CL_SUCCESS) return r;
+            }
+
+            return CL_SUCCESS;
+        }
+
+        // Allocate the staging buffers, writes fall back to regular heap memory
+        // if the driver doesn't provide (enough) pinned memory
+        //
+        // They're allocated on the first device, for the others they're just
+        // regular host memory.
+        static void init_staging(gpu& dev) {
+            staging_buffers.reserve(staging_count);
+
+            for (size_t i = 0; i < staging_count; i++) {
+                int r;
+                cl::Buffer buf(dev.context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, staging_size, nullptr, &r);
+                if (r != CL_SUCCESS) break;
+
+                void* data = dev.queues[0].enqueueMapBuffer(buf, true, CL_MAP_READ | CL_MAP_WRITE, 0, staging_size, nullptr, nullptr, &r);
+                if (r != CL_SUCCESS) break;
+
+                staging_buffers.push_back({buf, reinterpret_cast<char*>(data)});
+            }
+
+            for (auto& staging : staging_buffers) {
+                free_staging.push_back(&staging);
+            }
+        }
+
+        // PCI address of the device like 0000:65:00.0, which is reported by one
+        // of several vendor extensions, empty if none of them is supported
+        static std::string pci_address(const cl::Device& device) {
+#ifdef DEBUG
+            (void) device;
+            return "";
+#else
+            // Layouts of the extension queries, the headers may predate them
+            struct khr_bus_info {
+                cl_uint domain, bus, device, function;
+            } khr;
+
+            struct amd_topology {
+                cl_uint type;
+                cl_char unused[17];
+                cl_char bus, device, function;
+            } amd;
+
+            const cl_device_info khr_bus_info_query = 0x410F; // CL_DEVICE_PCI_BUS_INFO_KHR
+            const cl_device_info amd_topology_query = 0x4037; // CL_DEVICE_TOPOLOGY_AMD
+            const cl_uint amd_topology_pcie = 1; // CL_DEVICE_TOPOLOGY_TYPE_PCIE_AMD
+            const cl_device_info nv_bus_query = 0x4008; // CL_DEVICE_PCI_BUS_ID_NV
+            const cl_device_info nv_slot_query = 0x4009; // CL_DEVICE_PCI_SLOT_ID_NV
+            const cl_device_info nv_domain_query = 0x400A; // CL_DEVICE_PCI_DOMAIN_ID_NV
+
+            unsigned domain = 0, bus, slot, function;
+            cl_uint nv_bus, nv_slot, nv_domain;
+
+            if (clGetDeviceInfo(device(), khr_bus_info_query, sizeof(khr), &khr, nullptr) == CL_SUCCESS) {
+                domain = khr.domain;
+                bus = khr.bus;
+                slot = khr.device;
+                function = khr.function;
+            } else if (clGetDeviceInfo(device(), amd_topology_query, sizeof(amd), &amd, nullptr) == CL_SUCCESS &&
+                    amd.type == amd_topology_pcie) {
+                bus = (unsigned char) amd.bus;
+                slot = (unsigned char) amd.device;
+                function = (unsigned char) amd.function;
+            } else if (clGetDeviceInfo(device(), nv_bus_query, sizeof(nv_bus), &nv_bus, nullptr) == CL_SUCCESS &&
+                    clGetDeviceInfo(device(), nv_slot_query, sizeof(nv_slot), &nv_slot, nullptr) == CL_SUCCESS) {
+                if (clGetDeviceInfo(device(), nv_domain_query, sizeof(nv_domain), &nv_domain, nullptr) == CL_SUCCESS) {
+                    domain = nv_domain;
+                }
+
+                bus = nv_bus;
+                slot = nv_slot >> 3;
+                function = nv_slot & 7;
+            } else {
+                return "";
+            }
+
+            char address[32];
+            snprintf(address, sizeof(address), "%04x:%02x:%02x.%x", domain, bus, slot, function);
+            return address;
+#endif
+        }
+
+        // Set up the context and queues of a device
+        static bool init_device(gpu& dev, cl::Platform& platform) {
+            dev.context = cl::Context(dev.device);
 
-        std::vector<cl::Buffer> pool;
-        int total_blocks = 0;
+            for (size_t i = 0; i < queue_count; i++) {
+                dev.queues.push_back(cl::CommandQueue(dev.context, dev.device, CL_QUEUE_PROFILING_ENABLE));
+                dev.read_queues.push_back(cl::CommandQueue(dev.context, dev.device, CL_QUEUE_PROFILING_ENABLE));
+            }
+
+            cl_uint version = cl::detail::getPlatformVersion(platform());
+
+            if (version >= (1 << 16 | 2))
+                dev.has_fillbuffer = true;
+
+            if (!dev.has_fillbuffer) {
+                std::vector<char> zero_data(chunk_size);
+                int r;
+                dev.zero_buffer = cl::Buffer(dev.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, chunk_size, zero_data.data(), &r);
+                if (r != CL_SUCCESS) return false;
+            }
 
-        size_t device_num;
+            cl_ulong max_alloc = 0;
+            if (dev.device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &max_alloc) == CL_SUCCESS && max_alloc >= chunk_size) {
+                dev.slab_size = std::min(max_slab_size, (size_t) (max_alloc / chunk_size) * chunk_size);
+            } else {
+                dev.slab_size = chunk_size;
+            }
 
-        // Fill buffer with zeros
-        static int clear_buffer(cl::Buffer& buf) {
-            if (has_fillbuffer)
-                return queue.enqueueFillBuffer(buf, 0, 0, block::size, nullptr, nullptr);
-            else
-                return queue.enqueueCopyBuffer(zero_buffer, buf, 0, 0, block::size, nullptr, nullptr);
+            return true;
         }
 
-        // Find platform with OpenCL capable GPU
+        // Find the selected OpenCL capable GPUs, numbered like list_devices()
         static bool init_opencl() {
             if (ready) return true;
 
@@ -32,49 +567,190 @@ namespace vram {
             cl::Platform::get(&platforms);
             if (platforms.size() == 0) return false;
 
-            auto index = device_num;
+            gpus.resize(device_nums.size());
+
+            size_t first_index = 0;
             for (auto& platform : platforms) {
                 std::vector<cl::Device> gpu_devices;
                 platform.getDevices(CL_DEVICE_TYPE_GPU, &gpu_devices);
-                if (index >= gpu_devices.size())
-                {
-                    index -= gpu_devices.size();
-                    continue;
-                }
 
-                device = gpu_devices[index];
-                context = cl::Context(gpu_devices);
-                queue = cl::CommandQueue(context, device);
+                for (size_t i = 0; i < device_nums.size(); i++) {
+                    size_t num = device_nums[i];
+                    if (num < first_index || num >= first_index + gpu_devices.size()) continue;
 
-                cl_uint version = cl::detail::getPlatformVersion(platform());
+                    gpus[i].index = i;
+                    gpus[i].device = gpu_devices[num - first_index];
+                    if (!init_device(gpus[i], platform)) return false;
+                }
 
-                if (version >= (1 << 16 | 2))
-                    has_fillbuffer = true;
+                first_index += gpu_devices.size();
+            }
 
-                if (!has_fillbuffer) {
-                    char zero_data[block::size] = {};
-                    int r;
-                    zero_buffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, block::size, zero_data, &r);
-                    if (r != CL_SUCCESS) return false;
-                }
+            for (auto& dev : gpus) {
+                if (dev.queues.empty()) return false;
+            }
 
-                return true;
+            // Before anything else is allocated on the host, staging buffers are
+            // used by transfers to and from the first device
+            if (numa_binding) {
+                int node = numa::device_node(pci_address(gpus[0].device));
+                if (numa::bind(node)) bound_node = node;
             }
 
-            return false;
+            init_staging(gpus[0]);
+
+            return true;
+        }
+
+        // Called for asynchronous writes to recycle the staging buffer
+        static CL_CALLBACK void async_write_release(cl_event event, cl_int, void* data) {
+            record_transfer(event);
+            staging_release()(reinterpret_cast<staging_buffer*>(data));
+        }
+
+        // Called for transfers into the cache, which may stay there for a long time
+        static CL_CALLBACK void cache_fill_complete(cl_event event, cl_int, void*) {
+            record_transfer(event);
         }
 
         // Called for asynchronous writes to clean up the data copy
-        static CL_CALLBACK void async_write_dealloc(cl_event, cl_int, void* data) {
+        static CL_CALLBACK void async_write_dealloc(cl_event event, cl_int, void* data) {
+            record_transfer(event);
             delete [] reinterpret_cast<char*>(data);
         }
 
+        // Register a callback that cleans up after a transfer, if that fails
+        // it's waited for and called right away, so nothing is leaked
+        static void when_complete(cl::Event& event, CL_CALLBACK void (*callback)(cl_event, cl_int, void*), void* data) {
+            if (event.setCallback(CL_COMPLETE, callback, data) == CL_SUCCESS) return;
+
+            event.wait();
+            callback(event(), CL_COMPLETE, data);
+        }
+
+        // Take *size* bytes of a budget, returns false if it's exhausted, unless
+        // *wait* is set, then it waits for transfers to complete instead
+        //
+        // Anything that's waited for has to be submitted to the device first,
+        // otherwise the completion callbacks may never run.
+        static bool take_budget(transfer_budget& budget, size_t size, bool wait) {
+            std::unique_lock<std::mutex> local_lock(budget.mutex);
+
+            // A single transfer larger than the limit can still be issued by itself
+            auto fits = [&] {
+                return budget.in_flight == 0 || budget.in_flight + size <= budget.limit * gpus.size();
+            };
+
+            if (!fits()) {
+                if (!wait) return false;
+
+                stats::add(stats::counter::writes_throttled);
+
+                local_lock.unlock();
+                for (auto& dev : gpus) {
+                    for (auto& queue : dev.queues) queue.flush();
+                }
+                local_lock.lock();
+
+                budget.cv.wait(local_lock, fits);
+            }
+
+            budget.in_flight += size;
+            return true;
+        }
+
+        // Count a transfer against a budget without waiting, for transfers
+        // that are limited by other means
+        static void charge_budget(transfer_budget& budget, size_t size) {
+            std::lock_guard<std::mutex> local_lock(budget.mutex);
+            budget.in_flight += size;
+        }
+
+        static void return_budget(transfer_budget& budget, size_t size) {
+            {
+                std::lock_guard<std::mutex> local_lock(budget.mutex);
+                budget.in_flight -= size;
+            }
+
+            budget.cv.notify_all();
+        }
+
+        // Called for asynchronous writes and prefetches with the size of the
+        // transfer to return it to the budget
+        static CL_CALLBACK void write_back_complete(cl_event, cl_int, void* data) {
+            return_budget(write_back_budget, reinterpret_cast<uintptr_t>(data));
+        }
+
+        static CL_CALLBACK void prefetch_complete(cl_event, cl_int, void* data) {
+            return_budget(prefetch_budget, reinterpret_cast<uintptr_t>(data));
+        }
+
+        void staging_release::operator()(staging_buffer* staging) const {
+            std::lock_guard<std::mutex> local_lock(staging_mutex);
+            free_staging.push_back(staging);
+        }
+
+        staging_ref acquire_staging() {
+            std::lock_guard<std::mutex> local_lock(staging_mutex);
+
+            if (free_staging.empty()) return nullptr;
+
+            auto staging = free_staging.back();
+            free_staging.pop_back();
+            return staging_ref(staging);
+        }
+
+        size_t class_size(int cls) {
+            return class_sizes[cls];
+        }
+
+        int find_class(size_t size) {
+            for (int cls = 0; cls < class_count; cls++) {
+                if (class_sizes[cls] == size) return cls;
+            }
+
+            return -1;
+        }
+
+        void set_default_class(int cls) {
+            first_class = cls;
+        }
+
+        int default_class() {
+            return first_class;
+        }
+
+        void set_dedup(bool enabled) {
+            dedup = enabled;
+        }
+
+        bool dedup_enabled() {
+            return dedup;
+        }
+
+        void set_numa_binding(bool enabled) {
+            numa_binding = enabled;
+        }
+
+        int numa_node() {
+            return bound_node;
+        }
+
+        void set_background_limits(size_t write_back, size_t prefetch) {
+            write_back_budget.limit = write_back;
+            prefetch_budget.limit = prefetch;
+        }
+
         bool is_available() {
             return (ready = init_opencl());
         }
 
-        void set_device(size_t device) {
-            device_num = device;
+        void set_devices(const std::vector<size_t>& nums) {
+            device_nums = nums;
+        }
+
+        size_t device_count() {
+            return gpus.size();
         }
 
         std::vector<std::string> list_devices() {
@@ -95,85 +771,1105 @@ namespace vram {
             return device_names;
         }
 
-        int pool_size() {
-            return total_blocks;
+        size_t pool_size() {
+            std::lock_guard<std::mutex> local_lock(pool_mutex);
+            return std::max(pool_bytes, pool_limit);
         }
 
-        int pool_available() {
-            return pool.size();
+        size_t pool_available() {
+            std::lock_guard<std::mutex> local_lock(pool_mutex);
+            return available_bytes + (std::max(pool_bytes, pool_limit) - pool_bytes);
         }
 
-        size_t increase_pool(size_t size) {
-            int block_count = 1 + (size - 1) / block::size;
+        size_t pool_allocated() {
+            std::lock_guard<std::mutex> local_lock(pool_mutex);
+            return pool_bytes;
+        }
+
+        // Add the specified number of chunks to the pool of a device, returns
+        // the number actually added
+        static size_t grow_device(gpu& dev, size_t chunk_count) {
+            size_t allocated = 0;
             int r;
 
-            for (int i = 0; i < block_count; i++) {
-                cl::Buffer buf(context, CL_MEM_READ_WRITE, block::size, nullptr, &r);
+            while (allocated < chunk_count) {
+                size_t slab_chunks = std::min(dev.slab_size / chunk_size, chunk_count - allocated);
 
-                if (r == CL_SUCCESS && clear_buffer(buf) == CL_SUCCESS) {
-                    pool.push_back(buf);
-                    total_blocks++;
-                } else {
-                    return i * block::size;
+                cl::Buffer buf(dev.context, CL_MEM_READ_WRITE, slab_chunks * chunk_size, nullptr, &r);
+
+                // Blocks don't rely on the memory being cleared, but some
+                // drivers only reserve it once a buffer is first used, so it's
+                // touched to find out if it's actually available
+                if (r != CL_SUCCESS || clear_buffer(dev, dev.queues[0], buf, 0, class_sizes[0]) != CL_SUCCESS) {
+                    // Try smaller slabs before giving up, the device may not be
+                    // able to fit the remaining memory in one piece
+                    if (dev.slab_size == chunk_size) break;
+                    dev.slab_size = std::max(chunk_size, (dev.slab_size / 2 / chunk_size) * chunk_size);
+                    continue;
+                }
+
+                // Touching happens on the first queue, but the blocks may end up
+                // on any of them, so it has to be finished before handing them out
+                dev.queues[0].finish();
+
+                std::lock_guard<std::mutex> local_lock(pool_mutex);
+
+                dev.slabs.emplace_back(new slab());
+                slab* s = dev.slabs.back().get();
+                s->buffer = buf;
+                s->chunk_count = slab_chunks;
+                s->free_count = slab_chunks;
+                s->idle_since = clock::now();
+
+                for (size_t i = 0; i < slab_chunks; i++) {
+                    dev.chunks.emplace_back(new chunk());
+                    dev.chunks.back()->dev = &dev;
+                    dev.chunks.back()->parent = s;
+                    dev.chunks.back()->buffer = buf;
+                    dev.chunks.back()->base = i * chunk_size;
+                    dev.free_chunks.push_back(dev.chunks.back().get());
                 }
+
+                allocated += slab_chunks;
+                pool_bytes += slab_chunks * chunk_size;
+                available_bytes += slab_chunks * chunk_size;
             }
 
-            return block_count * block::size;
+            return allocated;
         }
 
-        block_ref allocate() {
-            if (pool.size() != 0) {
-                return block_ref(new block());
-            } else {
-                return nullptr;
+        size_t increase_pool(size_t size) {
+            size_t chunk_count = 1 + (size - 1) / chunk_size;
+            size_t allocated = 0;
+
+            // Spread evenly over the devices, devices that run out leave the
+            // rest of their share to the ones after them
+            for (size_t i = 0; i < gpus.size(); i++) {
+                size_t remaining = gpus.size() - i;
+                size_t share = (chunk_count - allocated + remaining - 1) / remaining;
+
+                allocated += grow_device(gpus[i], share);
             }
+
+            return allocated * chunk_size;
         }
 
-        block::block() {
-            buffer = pool.back();
-            pool.pop_back();
+        // Check if the background thread may still add memory to a device,
+        // requires pool_mutex
+        static bool can_grow(const gpu& dev) {
+            return pool_bytes < pool_limit && clock::now() - dev.grow_failed_at >= grow_retry_delay;
         }
 
-        block::~block() {
-            pool.push_back(buffer);
+        static void request_growth(gpu& dev) {
+            dev.grow_requested = true;
+            grow_requested = true;
+            grow_cv.notify_one();
         }
 
-        void block::read(off_t offset, size_t size, void* data) const {
-            if (dirty) {
-                memset(data, 0, size);
-            } else {
-                // Queue is configured for in-order execution, so writes before this
-                // are guaranteed to be completed first
-                queue.enqueueReadBuffer(buffer, true, offset, size, data, nullptr, nullptr);
+        // Give slabs without blocks that have been idle for a while back to the
+        // driver, as long as the pool stays at least as large as its reserve
+        static void release_idle_slabs(gpu& dev) {
+            auto now = clock::now();
+
+            for (size_t i = dev.slabs.size(); i-- > 0;) {
+                slab* s = dev.slabs[i].get();
+                size_t bytes = s->chunk_count * chunk_size;
+
+                if (s->free_count < s->chunk_count) continue;
+                if (now - s->idle_since < release_delay) continue;
+                if (pool_bytes - bytes < pool_reserve) continue;
+
+                auto in_slab = [s] (const chunk* c) { return c->parent == s; };
+                dev.free_chunks.erase(std::remove_if(dev.free_chunks.begin(), dev.free_chunks.end(), in_slab), dev.free_chunks.end());
+                dev.chunks.erase(std::remove_if(dev.chunks.begin(), dev.chunks.end(),
+                    [s] (const std::unique_ptr<chunk>& c) { return c->parent == s; }), dev.chunks.end());
+                dev.slabs.erase(dev.slabs.begin() + i);
+
+                pool_bytes -= bytes;
+                available_bytes -= bytes;
             }
         }
 
-        void block::write(off_t offset, size_t size, const void* data, bool async) {
-            // If this block has not been written to yet, and this call doesn't
-            // overwrite the entire block, clear with zeros first
-            if (dirty && size != block::size) {
-                clear_buffer(buffer);
-            }
+        static void manage_pool() {
+            std::unique_lock<std::mutex> local_lock(pool_mutex);
 
-            if (async) {
-                char* data_copy = new char[size];
-                memcpy(data_copy, data, size);
-                data = data_copy;
-            }
+            auto woken = [] { return grow_requested || manager.stop; };
 
-            cl::Event event;
-            queue.enqueueWriteBuffer(buffer, !async, offset, size, data, nullptr, &event);
+            while (true) {
+                if (release_delay.count() > 0) {
+                    grow_cv.wait_for(local_lock, release_delay, woken);
+                } else {
+                    grow_cv.wait(local_lock, woken);
+                }
 
-            if (async) {
-                event.setCallback(CL_COMPLETE, async_write_dealloc, const_cast<void*>(data));
-            }
+                if (manager.stop) {
+                    break;
+                } else if (grow_requested) {
+                    grow_requested = false;
 
-            last_write = event;
-            dirty = false;
-        }
+                    for (auto& dev : gpus) {
+                        if (!dev.grow_requested) continue;
+                        dev.grow_requested = false;
 
-        void block::sync() {
-            last_write.wait();
+                        if (can_grow(dev)) {
+                            size_t count = std::min(dev.slab_size, pool_limit - pool_bytes) / chunk_size;
+                            dev.growing = true;
+
+                            local_lock.unlock();
+                            size_t added = grow_device(dev, std::max(count, (size_t) 1));
+                            local_lock.lock();
+
+                            dev.growing = false;
+                            if (added == 0) dev.grow_failed_at = clock::now();
+                        }
+
+                        grown_cv.notify_all();
+                    }
+                } else {
+                    for (auto& dev : gpus) {
+                        release_idle_slabs(dev);
+                    }
+                }
+            }
+        }
+
+        void grow_pool(size_t limit, unsigned idle_release) {
+            {
+                std::lock_guard<std::mutex> local_lock(pool_mutex);
+
+                pool_limit = limit;
+                pool_reserve = pool_bytes;
+                release_delay = std::chrono::seconds(idle_release);
+
+                for (auto& dev : gpus) {
+                    dev.grow_failed_at = clock::now() - grow_retry_delay;
+                }
+            }
+
+            manager.thread = std::thread(manage_pool);
+        }
+
+        size_t next_queue() {
+            return queue_counter++ % queue_count;
+        }
+
+        // Find a chunk of the device with a free block of the class, splitting
+        // a free chunk if needed, returns nullptr if the device is full
+        static chunk* find_chunk(gpu& dev, int cls, std::unique_lock<std::mutex>& local_lock) {
+            auto& partial = dev.partial_chunks[cls];
+
+            if (!partial.empty()) return partial.front();
+
+            while (dev.free_chunks.empty()) {
+                if (!dev.growing && !can_grow(dev)) return nullptr;
+
+                request_growth(dev);
+                grown_cv.wait(local_lock);
+
+                if (!partial.empty()) return partial.front();
+            }
+
+            chunk* c = dev.free_chunks.back();
+            dev.free_chunks.pop_back();
+            c->parent->free_count--;
+
+            if (dev.free_chunks.size() < grow_threshold && can_grow(dev)) {
+                request_growth(dev);
+            }
+
+            // Blocks of the new class can overlap any of the blocks from
+            // before, so simply wait for all of their writes
+            if (!c->retired.empty()) {
+                cl::WaitForEvents(c->retired);
+                c->retired.clear();
+            }
+
+            c->cls = cls;
+            for (size_t off = chunk_size; off > 0; off -= class_sizes[cls]) {
+                c->free_slots.push_back({(off_t) (c->base + off - class_sizes[cls]), cl::Event(), {}});
+            }
+
+            partial.push_front(c);
+            c->partial = partial.begin();
+
+            return c;
+        }
+
+        // Evict cold blocks of the device until there is room for a block of
+        // the class, returns false if nothing could be evicted, requires pool_mutex
+        //
+        // The clock goes over chunks rather than blocks, since a chunk of
+        // another class has to be emptied entirely to make room.
+        bool evict(gpu& dev, int cls) {
+            size_t count = dev.chunks.size();
+
+            for (size_t step = 0; step < 3 * count; step++) {
+                chunk* c = dev.chunks[dev.clock_hand++ % count].get();
+                if (c->cls < 0) continue;
+
+                // Chunks that were used since the hand passed last get another
+                // round, unless everything keeps being used
+                if (c->referenced.exchange(false) && step < 2 * count) continue;
+
+                bool evicted = false;
+                auto victims = c->blocks;
+
+                for (block* victim : victims) {
+                    // Blocks that are being accessed are skipped, instead of waiting
+                    std::unique_lock<std::mutex> victim_lock(victim->residency, std::try_to_lock);
+                    if (!victim_lock || victim->pins > 0) continue;
+
+                    victim->evict();
+                    evicted = true;
+
+                    if (c->cls == cls || c->cls < 0) return true;
+                }
+
+                // Slots of another class are left free for later
+                if (evicted && c->cls < 0) return true;
+            }
+
+            return false;
+        }
+
+        // Take a free slot of the class on the device of the stripe, or any
+        // other if it's full, evicting blocks once all of them are full (if
+        // enabled), returns nullptr if there is no room
+        static chunk* take_slot(int cls, size_t stripe, free_slot& slot, std::unique_lock<std::mutex>& local_lock) {
+            chunk* c = nullptr;
+            for (size_t i = 0; i < gpus.size() && !c; i++) {
+                c = find_chunk(gpus[(stripe + i) % gpus.size()], cls, local_lock);
+            }
+
+            // Blocks that are being accessed can't be evicted, which usually
+            // doesn't last long, so it's retried for a while before giving up
+            for (int attempt = 0; !c && spill_fd >= 0 && attempt < evict_attempts; attempt++) {
+                if (attempt > 0) {
+                    local_lock.unlock();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    local_lock.lock();
+                }
+
+                for (size_t i = 0; i < gpus.size() && !c; i++) {
+                    gpu& dev = gpus[(stripe + i) % gpus.size()];
+
+                    c = find_chunk(dev, cls, local_lock);
+
+                    while (!c && evict(dev, cls)) {
+                        c = find_chunk(dev, cls, local_lock);
+                    }
+                }
+            }
+
+            if (!c) return nullptr;
+
+            slot = c->free_slots.back();
+            c->free_slots.pop_back();
+            c->used++;
+
+            if (c->free_slots.empty()) {
+                c->dev->partial_chunks[cls].erase(c->partial);
+            }
+
+            available_bytes -= class_sizes[cls];
+
+            // A new block is about to be used, it shouldn't be the next victim
+            c->referenced = true;
+
+            return c;
+        }
+
+        block_ref allocate(int cls, size_t queue, size_t stripe) {
+            std::unique_lock<std::mutex> local_lock(pool_mutex);
+
+            free_slot slot;
+            chunk* c = take_slot(cls, stripe, slot, local_lock);
+            if (!c) return nullptr;
+
+            return block_ref(new block(c, slot.offset, cls, queue % queue_count, slot.last_write, slot.copies));
+        }
+
+        // Completion of the writes of a write_set that is waited for asynchronously
+        struct write_set_wait {
+            std::atomic<size_t> remaining;
+            std::function<void()> done;
+        };
+
+        static CL_CALLBACK void write_set_complete(cl_event, cl_int, void* data) {
+            auto pending = reinterpret_cast<write_set_wait*>(data);
+
+            if (--pending->remaining == 0) {
+                pending->done();
+                delete pending;
+            }
+        }
+
+        void write_set::add(const block& written) {
+            std::lock_guard<std::mutex> local_lock(written.residency);
+
+            size_t index = written.device_index * queue_count + written.queue_num;
+
+            if (index >= events.size()) {
+                events.resize(index + 1);
+            }
+
+            events[index] = written.last_write;
+        }
+
+        void write_set::wait() const {
+            // Events of different devices belong to different contexts, so
+            // they can't be waited for together
+            for (auto event : events) {
+                if (event()) event.wait();
+            }
+        }
+
+        void write_set::wait(const std::function<void()>& done) const {
+            std::vector<cl::Event> pending;
+
+            for (auto& event : events) {
+                if (event()) pending.push_back(event);
+            }
+
+            if (pending.empty()) return done();
+
+            // Shared by the callbacks, the last one to run cleans it up
+            auto state = new write_set_wait();
+            state->remaining = pending.size();
+            state->done = done;
+
+            for (size_t i = 0; i < pending.size(); i++) {
+                if (pending[i].setCallback(CL_COMPLETE, write_set_complete, state) == CL_SUCCESS) continue;
+
+                // The events without a callback are waited for here instead,
+                // whoever finishes last calls *done*
+                size_t unregistered = pending.size() - i;
+
+                for (size_t j = i; j < pending.size(); j++) {
+                    pending[j].wait();
+                }
+
+                if (state->remaining.fetch_sub(unregistered) == unregistered) {
+                    state->done();
+                    delete state;
+                }
+
+                return;
+            }
+        }
+
+        block::block(chunk* owner, off_t offset, int cls, size_t queue, cl::Event last_write, std::vector<cl::Event> copies) :
+            pins(0), owner(owner), offset(offset), cls(cls), chunk_index(owner->blocks.size()),
+            device_index(owner->dev->index), last_write(last_write), copies(std::move(copies)), queue_num(queue) {
+            owner->blocks.push_back(this);
+        }
+
+        // Block that find_block() compares the data with
+        static block_ref find_candidate(int cls, const util::hash128& contents) {
+            block_ref found;
+
+            {
+                std::lock_guard<std::mutex> local_lock(dedup_mutex);
+
+                auto it = dedup_index.find(contents);
+                if (it != dedup_index.end()) found = it->second.lock();
+            }
+
+            // Released without the lock, since it may be the last reference
+            if (found && found->size() != class_sizes[cls]) found = nullptr;
+
+            return found;
+        }
+
+        block_ref find_block(int cls, const util::hash128& contents, const char* data) {
+            auto found = find_candidate(cls, contents);
+            if (!found) return nullptr;
+
+            // The hash only points out candidates, sharing a block with
+            // different data would silently corrupt the file
+            std::unique_ptr<char[]> found_data(new char[found->size()]);
+            found->read(0, found->size(), found_data.get());
+
+            if (memcmp(found_data.get(), data, found->size()) != 0) return nullptr;
+
+            return found;
+        }
+
+        block_ref find_block(int cls, const util::hash128& contents, const block& data) {
+            // Only read back if there is anything to compare with
+            auto found = find_candidate(cls, contents);
+            if (!found || found.get() == &data) return nullptr;
+
+            std::unique_ptr<char[]> block_data(new char[data.size()]);
+            data.read(0, data.size(), block_data.get());
+
+            return find_block(cls, contents, block_data.get());
+        }
+
+        block::~block() {
+            unpublish();
+            uncache(0, size());
+
+            std::lock_guard<std::mutex> local_lock(pool_mutex);
+            if (owner) release();
+        }
+
+        void block::publish(const util::hash128& contents) {
+            std::lock_guard<std::mutex> local_lock(dedup_mutex);
+
+            if (published || !dedup_index.emplace(contents, shared_from_this()).second) return;
+
+            published = true;
+            this->contents = contents;
+        }
+
+        void block::unpublish() {
+            if (!dedup) return;
+
+            std::lock_guard<std::mutex> local_lock(dedup_mutex);
+
+            if (!published) return;
+
+            dedup_index.erase(contents);
+            published = false;
+        }
+
+        void block::release() const {
+            // Takes the place of the last block in the list of the chunk
+            owner->blocks[chunk_index] = owner->blocks.back();
+            owner->blocks[chunk_index]->chunk_index = chunk_index;
+            owner->blocks.pop_back();
+
+            owner->free_slots.push_back({offset, last_write, std::move(copies)});
+            copies.clear();
+            owner->used--;
+            available_bytes += size();
+
+            auto& partial = owner->dev->partial_chunks[cls];
+
+            if (owner->used == 0) {
+                // Entire chunk is free again, so it can be used for any class
+                if (owner->free_slots.size() > 1) {
+                    partial.erase(owner->partial);
+                }
+
+                for (auto& slot : owner->free_slots) {
+                    if (slot.last_write()) owner->retired.push_back(slot.last_write);
+
+                    for (auto& copy : slot.copies) {
+                        if (copy()) owner->retired.push_back(copy);
+                    }
+                }
+
+                owner->free_slots.clear();
+                owner->cls = -1;
+                owner->dev->free_chunks.push_back(owner);
+
+                if (++owner->parent->free_count == owner->parent->chunk_count) {
+                    owner->parent->idle_since = clock::now();
+                }
+            } else if (owner->free_slots.size() == 1) {
+                partial.push_front(owner);
+                owner->partial = partial.begin();
+            }
+
+            owner = nullptr;
+        }
+
+        void block::evict() {
+            // Blocks that were never written to don't have any data to keep
+            if (written) {
+                clear_unwritten();
+
+                spilled = std::make_shared<spill_copy>(cls);
+
+                owner->dev->queues[queue_num].enqueueReadBuffer(owner->buffer, false, offset, size(), spilled->data.get(), nullptr, &spilled->transfer);
+                stats::add(stats::counter::bytes_from_device, size());
+
+                // The next owner of the memory waits for the copy to complete
+                last_write = spilled->transfer;
+
+                std::lock_guard<std::mutex> local_lock(spill_mutex);
+                spill_queue.push_back(spilled);
+                spill_cv.notify_one();
+            }
+
+            release();
+
+            stats::add(stats::counter::blocks_evicted);
+        }
+
+        void block::load(std::unique_lock<std::mutex>& local_lock) const {
+            while (!owner) {
+                free_slot slot;
+                chunk* c;
+
+                {
+                    std::unique_lock<std::mutex> pool_lock(pool_mutex);
+
+                    c = take_slot(cls, device_index, slot, pool_lock);
+
+                    if (c) {
+                        owner = c;
+                        offset = slot.offset;
+                        last_write = slot.last_write;
+                        copies = std::move(slot.copies);
+                        chunk_index = c->blocks.size();
+                        device_index = c->dev->index;
+                        c->blocks.push_back(const_cast<block*>(this));
+                    }
+                }
+
+                if (!c) {
+                    // Everything is being accessed right now, which is only the
+                    // case for a moment, so give the other threads some time
+                    local_lock.unlock();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    local_lock.lock();
+                    continue;
+                }
+
+                stats::add(stats::counter::blocks_loaded);
+
+                if (!spilled) continue;
+
+                std::unique_ptr<char[]> data;
+
+                {
+                    std::lock_guard<std::mutex> copy_lock(spilled->mutex);
+
+                    if (spilled->data) {
+                        spilled->transfer.wait();
+                        data = std::move(spilled->data);
+                    } else {
+                        data.reset(new char[size()]);
+
+                        if (!read_fully(data.get(), size(), spilled->file_offset)) {
+                            util::fatal_error("failed to read from spill file", 0);
+                        }
+                    }
+                }
+
+                spilled = nullptr;
+
+                // Transferred like a first write, which waits for the previous
+                // owner of the memory
+                written = 0;
+
+                cl::Event event;
+                if (const_cast<block*>(this)->enqueue_write(0, size(), data.get(), false, event) == CL_SUCCESS) {
+                    when_complete(event, async_write_dealloc, data.release());
+                }
+            }
+
+            owner->referenced = true;
+        }
+
+        size_t block::size() const {
+            return class_sizes[cls];
+        }
+
+        size_t block::device() const {
+            std::lock_guard<std::mutex> local_lock(residency);
+            return device_index;
+        }
+
+        transfer_batch::~transfer_batch() {
+            wait();
+        }
+
+        void transfer_batch::wait() {
+            issue();
+
+            // Events can only be waited for together if they belong to the
+            // same device
+            for (auto& event : events) {
+                event.wait();
+                record_transfer(event());
+            }
+            events.clear();
+
+            for (auto source : pinned) source->pins--;
+            pinned.clear();
+        }
+
+        void transfer_batch::read(const block* source, off_t offset, size_t size, char* data) {
+            size_t queue = source->queue_num;
+            const chunk* owner = source->owner;
+
+            // Blocks of the same slab that follow each other in VRAM and in
+            // the destination can be read with one command
+            bool adjacent = pending.size > 0 && queue == pending.queue && owner->parent == pending.owner->parent &&
+                offset == (off_t) (pending.offset + pending.size) && data == pending.data + pending.size;
+
+            if (adjacent) {
+                pending.size += size;
+            } else {
+                issue();
+                pending.queue = queue;
+                pending.owner = owner;
+                pending.offset = offset;
+                pending.size = size;
+                pending.data = data;
+            }
+
+            if (source->last_write()) pending.wait.push_back(source->last_write);
+
+            source->pins++;
+            pinned.push_back(source);
+        }
+
+        void transfer_batch::issue() {
+            if (pending.size == 0) return;
+
+            // Reads skip the writes of other blocks that are queued up by going
+            // through a queue of their own, so they wait for the last writes of
+            // their blocks explicitly
+            cl::Event event;
+            pending.owner->dev->read_queues[pending.queue].enqueueReadBuffer(pending.owner->buffer, false, pending.offset, pending.size,
+                pending.data, pending.wait.empty() ? nullptr : &pending.wait, &event);
+            events.push_back(event);
+
+            stats::add(stats::counter::bytes_from_device, pending.size);
+
+            pending.size = 0;
+            pending.wait.clear();
+        }
+
+        void block::read(off_t offset, size_t size, void* data) const {
+            transfer_batch batch;
+            read(offset, size, data, batch);
+            batch.wait();
+        }
+
+        void block::read(off_t offset, size_t size, void* data, transfer_batch& batch) const {
+            std::unique_lock<std::mutex> local_lock(residency);
+
+            // Blocks pinned by the batch can't make room for this one
+            if (!owner) batch.wait();
+            load(local_lock);
+
+            if (!(written & piece_mask(this->size(), offset, size, false))) {
+                memset(data, 0, size);
+                return;
+            }
+
+            // Cache lines and merged transfers may extend beyond the region, so
+            // they mustn't pick up leftover data from the rest of the block
+            clear_unwritten();
+
+            char* out = reinterpret_cast<char*>(data);
+
+            // Walk over cache lines in read region
+            off_t end_pos = offset + size;
+
+            for (off_t pos = offset; pos < end_pos;) {
+                off_t line = (pos / cache_line_size) * cache_line_size;
+                size_t line_size = std::min(cache_line_size, this->size() - line);
+                size_t part_size = std::min((size_t) (line + line_size - pos), (size_t) (end_pos - pos));
+
+                // Partial reads of a line go through the cache, because the rest
+                // of it is likely to be read soon as well, uncached full lines
+                // are read directly in as few transfers as possible
+                auto entry = cached(line, part_size != line_size);
+
+                if (entry) {
+                    entry->fill.wait();
+                    memcpy(out + (pos - offset), entry->data.get() + (pos - line), part_size);
+                } else {
+                    batch.read(this, this->offset + pos, part_size, out + (pos - offset));
+                }
+
+                pos += part_size;
+            }
+        }
+
+        void block::prefetch(off_t offset, size_t size) const {
+            std::unique_lock<std::mutex> local_lock(residency);
+            load(local_lock);
+
+            if (!written) return;
+
+            clear_unwritten();
+
+            off_t end_pos = std::min((size_t) (offset + size), this->size());
+
+            for (off_t line = (offset / cache_line_size) * cache_line_size; line < end_pos; line += cache_line_size) {
+                if (!cached(line, true, true)) break;
+            }
+        }
+
+        cache_ref block::cached(off_t line, bool fill, bool ahead) const {
+            std::vector<cache_ref> evicted;
+            std::lock_guard<std::mutex> local_lock(cache_mutex);
+
+            cache_key key(this, line);
+            auto it = cache.find(key);
+
+            if (it != cache.end()) {
+                if (fill) stats::add(stats::counter::cache_hits);
+
+                cache_lru.splice(cache_lru.begin(), cache_lru, it->second.second);
+                return it->second.first;
+            } else if (!fill) {
+                return nullptr;
+            }
+
+            // The transfer is issued with the lock held, so that other threads
+            // that find the entry always have an event to wait for
+            size_t line_size = std::min(cache_line_size, size() - line);
+
+            // Prefetches queue up behind the writes of the block, which also
+            // orders them before its eviction, while reads that are waited for
+            // right away get ahead of them
+            int r;
+            auto entry = std::make_shared<cache_entry>(line_size);
+
+            if (ahead) {
+                if (!take_budget(prefetch_budget, line_size, false)) {
+                    stats::add(stats::counter::prefetches_dropped);
+                    return nullptr;
+                }
+
+                r = owner->dev->queues[queue_num].enqueueReadBuffer(owner->buffer, false, offset + line, line_size, entry->data.get(), nullptr, &entry->fill);
+
+                if (r != CL_SUCCESS) {
+                    return_budget(prefetch_budget, line_size);
+                    return nullptr;
+                }
+
+                when_complete(entry->fill, prefetch_complete, reinterpret_cast<void*>((uintptr_t) line_size));
+            } else {
+                std::vector<cl::Event> wait;
+                if (last_write()) wait.push_back(last_write);
+
+                r = owner->dev->read_queues[queue_num].enqueueReadBuffer(owner->buffer, false, offset + line, line_size, entry->data.get(),
+                    wait.empty() ? nullptr : &wait, &entry->fill);
+                if (r != CL_SUCCESS) return nullptr;
+            }
+
+            entry->fill.setCallback(CL_COMPLETE, cache_fill_complete, nullptr);
+
+            stats::add(stats::counter::cache_misses);
+            stats::add(stats::counter::bytes_from_device, line_size);
+
+            cache_lru.push_front(key);
+            cache[key] = {entry, cache_lru.begin()};
+
+            // Evicted entries are destroyed after unlocking, since they may
+            // have to wait for their transfer
+            while (cache.size() > cache_lines) {
+                auto victim = cache.find(cache_lru.back());
+                evicted.push_back(victim->second.first);
+                cache.erase(victim);
+                cache_lru.pop_back();
+            }
+
+            return entry;
+        }
+
+        void block::write(off_t offset, size_t size, const void* data, bool async) {
+            // Background writes are held back before the block is locked, so
+            // that reads of it can still go ahead
+            if (async) take_budget(write_back_budget, size, true);
+
+            std::unique_lock<std::mutex> local_lock(residency);
+            load(local_lock);
+
+            cl::Event event;
+
+            if (!async) {
+                enqueue_write(offset, size, data, true, event);
+                return;
+            }
+
+            // Asynchronous writes need a copy of the data, which preferably
+            // lives in pinned memory so that the driver can DMA from it directly
+            staging_ref staging;
+            if (size <= staging_size) staging = acquire_staging();
+
+            std::unique_ptr<char[]> data_copy;
+            if (!staging) data_copy.reset(new char[size]);
+
+            char* copy = staging ? staging->data : data_copy.get();
+            memcpy(copy, data, size);
+
+            // Nothing calls back for a write that wasn't issued, the copy is
+            // released by going out of scope instead
+            if (enqueue_write(offset, size, copy, false, event) != CL_SUCCESS) {
+                return_budget(write_back_budget, size);
+                return;
+            }
+
+            if (staging) {
+                when_complete(event, async_write_release, staging.release());
+            } else {
+                when_complete(event, async_write_dealloc, data_copy.release());
+            }
+
+            when_complete(event, write_back_complete, reinterpret_cast<void*>((uintptr_t) size));
+        }
+
+        void block::write(off_t offset, size_t size, const void* data, transfer_batch& batch) {
+            std::unique_lock<std::mutex> local_lock(residency);
+            load(local_lock);
+
+            cl::Event event;
+            if (enqueue_write(offset, size, data, false, event) == CL_SUCCESS) {
+                batch.events.push_back(event);
+            }
+        }
+
+        void block::write(off_t offset, size_t size, staging_ref staging, off_t staging_offset) {
+            // Called from flush and release, which mustn't block, and there
+            // are only a few staging buffers anyway, but the writes still
+            // count for the others
+            charge_budget(write_back_budget, size);
+
+            std::unique_lock<std::mutex> local_lock(residency);
+            load(local_lock);
+
+            cl::Event event;
+
+            if (enqueue_write(offset, size, staging->data + staging_offset, false, event) != CL_SUCCESS) {
+                return_budget(write_back_budget, size);
+                return;
+            }
+
+            // Ownership passes to the callback
+            when_complete(event, async_write_release, staging.release());
+            when_complete(event, write_back_complete, reinterpret_cast<void*>((uintptr_t) size));
+        }
+
+        int block::enqueue_write(off_t offset, size_t size, const void* data, bool blocking, cl::Event& event) {
+            auto& queue = owner->dev->queues[queue_num];
+
+            std::vector<cl::Event> pending_copies = copies;
+
+            std::vector<cl::Event> wait;
+            write_dependencies(wait);
+            const std::vector<cl::Event>* wait_list = wait.empty() ? nullptr : &wait;
+
+            // Pieces that are only partially overwritten are cleared first if
+            // they haven't been written to yet
+            uint64_t touched = piece_mask(this->size(), offset, size, false);
+            clear_pieces(touched & ~piece_mask(this->size(), offset, size, true) & ~written, wait_list);
+
+            int r = queue.enqueueWriteBuffer(owner->buffer, blocking, this->offset + offset, size, data, wait_list, &event);
+
+            if (r != CL_SUCCESS) {
+                // Unless a clear was issued, nothing was ordered after the
+                // copies from the block, so the next change still has to wait
+                if (wait_list) copies = std::move(pending_copies);
+                return r;
+            }
+
+            stats::add(stats::counter::bytes_to_device, size);
+            if (blocking) record_transfer(event());
+
+            last_write = event;
+            written |= touched;
+
+            // Keep cached copies up-to-date, after the transfer into them
+            // completes, because that still contains the old data
+            off_t end_pos = offset + size;
+
+            for (off_t line = (offset / cache_line_size) * cache_line_size; line < end_pos; line += cache_line_size) {
+                auto entry = cached(line, false);
+
+                if (entry) {
+                    off_t start = std::max(offset, line);
+                    off_t end = std::min(end_pos, (off_t) (line + cache_line_size));
+
+                    entry->fill.wait();
+                    memcpy(entry->data.get() + (start - line), reinterpret_cast<const char*>(data) + (start - offset), end - start);
+                }
+            }
+
+            return CL_SUCCESS;
+        }
+
+        void block::clear_pieces(uint64_t pieces, const std::vector<cl::Event>*& wait_list) const {
+            size_t piece = size() / block_pieces;
+
+            // Consecutive pieces are cleared with a single command
+            for (int first = 0; first < block_pieces;) {
+                if (!(pieces >> first & 1)) {
+                    first++;
+                    continue;
+                }
+
+                int end = first + 1;
+                while (end < block_pieces && (pieces >> end & 1)) end++;
+
+                cl::Event event;
+                clear_buffer(*owner->dev, owner->dev->queues[queue_num], owner->buffer,
+                    offset + first * piece, (end - first) * piece, wait_list, &event);
+
+                last_write = event;
+                wait_list = nullptr;
+
+                first = end;
+            }
+
+            written |= pieces;
+        }
+
+        void block::clear_unwritten() const {
+            // Nothing was issued for blocks that haven't been written to at all,
+            // so their previous owner isn't waited for here
+            if (!written || written == all_pieces) return;
+
+            std::vector<cl::Event> wait;
+            write_dependencies(wait);
+            const std::vector<cl::Event>* wait_list = wait.empty() ? nullptr : &wait;
+
+            clear_pieces(~written, wait_list);
+        }
+
+        void block::write_dependencies(std::vector<cl::Event>& wait) const {
+            // The previous owner of the memory may have issued writes on another
+            // queue that are still pending, so the first command has to wait
+            if (!written && last_write()) wait.push_back(last_write);
+
+            // Commands issued after this one on the queue of the block are
+            // ordered after the copies as well
+            for (auto& copy : copies) {
+                if (copy()) wait.push_back(copy);
+            }
+
+            copies.clear();
+        }
+
+        void block::zero(off_t offset, size_t size) {
+            std::unique_lock<std::mutex> local_lock(residency);
+            load(local_lock);
+
+            // Parts of a block that haven't been written to read as zeros
+            // already, their first write clears the rest
+            if (!(written & piece_mask(this->size(), offset, size, false))) return;
+
+            std::vector<cl::Event> wait;
+            write_dependencies(wait);
+
+            cl::Event event;
+            clear_buffer(*owner->dev, owner->dev->queues[queue_num], owner->buffer, this->offset + offset, size,
+                wait.empty() ? nullptr : &wait, &event);
+
+            last_write = event;
+
+            // Cached copies are cleared after their transfer completes
+            off_t end_pos = offset + size;
+
+            for (off_t line = (offset / cache_line_size) * cache_line_size; line < end_pos; line += cache_line_size) {
+                auto entry = cached(line, false);
+
+                if (entry) {
+                    off_t start = std::max(offset, line);
+                    off_t end = std::min(end_pos, (off_t) (line + cache_line_size));
+
+                    entry->fill.wait();
+                    memset(entry->data.get() + (start - line), 0, end - start);
+                }
+            }
+        }
+
+        void block::copy(off_t offset, size_t size, const block& src, off_t src_offset) {
+            std::unique_lock<std::mutex> local_lock(residency, std::defer_lock);
+            std::unique_lock<std::mutex> src_lock(src.residency, std::defer_lock);
+
+            if (&src == this) {
+                local_lock.lock();
+                load(local_lock);
+            } else {
+                // Either block may have to be loaded, which may sleep without its
+                // own lock while the other one stays locked, but that doesn't
+                // prevent the evictions it waits for
+                std::lock(local_lock, src_lock);
+                load(local_lock);
+                src.load(src_lock);
+            }
+
+            // Parts of blocks that haven't been written to only contain leftover data
+            if (!(src.written & piece_mask(src.size(), src_offset, size, false))) {
+                if (&src != this) src_lock.unlock();
+                local_lock.unlock();
+
+                zero(offset, size);
+                return;
+            }
+
+            // Devices can't access each other's memory, so the data makes a
+            // round trip through the host instead
+            if (src.owner->dev != owner->dev) {
+                if (&src != this) src_lock.unlock();
+                local_lock.unlock();
+
+                std::unique_ptr<char[]> data(new char[size]);
+                src.read(src_offset, size, data.get());
+                write(offset, size, data.get());
+                return;
+            }
+
+            auto& queue = owner->dev->queues[queue_num];
+
+            src.clear_unwritten();
+
+            // The source may have writes pending on another queue, just like
+            // the previous owner of this block
+            std::vector<cl::Event> wait;
+            if (src.last_write()) wait.push_back(src.last_write);
+            write_dependencies(wait);
+            const std::vector<cl::Event>* wait_list = wait.empty() ? nullptr : &wait;
+
+            uint64_t touched = piece_mask(this->size(), offset, size, false);
+            clear_pieces(touched & ~piece_mask(this->size(), offset, size, true) & ~written, wait_list);
+
+            cl::Event event;
+            queue.enqueueCopyBuffer(src.owner->buffer, owner->buffer, src.offset + src_offset, this->offset + offset, size, wait_list, &event);
+
+            last_write = event;
+            written |= touched;
+
+            // Writes to the source and the next owner of its memory wait for the
+            // copy, which runs on the queue of this block, the last copy on each
+            // queue implies the earlier ones
+            if (&src != this) {
+                if (src.copies.size() < queue_count) src.copies.resize(queue_count);
+                src.copies[queue_num] = event;
+            }
+
+            // Cached copies are simply read again when they're needed, the
+            // transfer into them is ordered before the copy
+            uncache(offset, size);
+        }
+
+        void block::uncache(off_t offset, size_t size) {
+            // Entries are destroyed after unlocking, since they may have to
+            // wait for their transfer
+            std::vector<cache_ref> evicted;
+            std::lock_guard<std::mutex> local_lock(cache_mutex);
+
+            for (off_t line = (offset / cache_line_size) * cache_line_size; line < (off_t) (offset + size); line += cache_line_size) {
+                auto it = cache.find(cache_key(this, line));
+
+                if (it != cache.end()) {
+                    evicted.push_back(it->second.first);
+                    cache_lru.erase(it->second.second);
+                    cache.erase(it);
+                }
+            }
+        }
+
+        void block::sync() {
+            cl::Event event;
+
+            {
+                std::lock_guard<std::mutex> local_lock(residency);
+                event = last_write;
+            }
+
+            event.wait();
         }
     }
 }
@@ -0,0 +1,90 @@
+#include "numa.hpp"
+
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+namespace vram {
+    namespace numa {
+        // Read the first line of a file in sysfs, returns false if it doesn't exist
+        static bool read_line(const string& path, string& line) {
+            std::ifstream file(path);
+            return file && std::getline(file, line);
+        }
+
+        int device_node(const string& address) {
+            // A single node is usually reported as "0", but may also be a range
+            string online;
+            if (!read_line("/sys/devices/system/node/online", online) || online == "0") return -1;
+
+            string node;
+            if (!read_line("/sys/bus/pci/devices/" + address + "/numa_node", node)) return -1;
+
+            try {
+                return std::max(std::stoi(node), -1);
+            } catch (const std::exception&) {
+                return -1;
+            }
+        }
+
+        // Parse a list of CPUs like 0-15,32-47 into a set
+        static bool parse_cpus(const string& list, cpu_set_t& cpus) {
+            CPU_ZERO(&cpus);
+
+            std::stringstream ranges(list);
+            string range;
+            int count = 0;
+
+            while (std::getline(ranges, range, ',')) {
+                int first, last;
+                char dash;
+
+                std::stringstream bounds(range);
+                if (!(bounds >> first)) return false;
+                if (!(bounds >> dash >> last)) last = first;
+
+                for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                    CPU_SET(cpu, &cpus);
+                    count++;
+                }
+            }
+
+            return count > 0;
+        }
+
+        bool bind(int node) {
+            if (node < 0) return false;
+
+            // Memory is only preferred, so allocations still succeed once the
+            // node runs out of it
+            const size_t word_bits = 8 * sizeof(unsigned long);
+            std::vector<unsigned long> nodes(node / word_bits + 1);
+            nodes[node / word_bits] = 1UL << (node % word_bits);
+
+            // The kernel expects one more than the number of bits in the mask
+            if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes.data(), nodes.size() * word_bits + 1) != 0) return false;
+
+            // The memory is what matters most, so threads that can't be moved
+            // (like in a restricted cpuset) don't undo that
+            string list;
+            cpu_set_t cpus;
+
+            bool placed = read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", list) &&
+                parse_cpus(list, cpus) &&
+                sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+
+            if (!placed) {
+                std::cerr << "warning: failed to run on the cpus of numa node " << node << std::endl;
+            }
+
+            return true;
+        }
+    }
+}
@@ -0,0 +1,189 @@
+#include "preload.hpp"
+#include "stats.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace vram {
+    namespace preload {
+        // Files are read by this many threads, every one of them keeps a few
+        // transfers in flight through the asynchronous writes
+        const size_t thread_count = 8;
+
+        // Regular file that has been created, but not filled yet
+        struct pending_file {
+            entry::file_ref file;
+            string path;
+            struct stat info;
+        };
+
+        static bool report(const string& path, int err) {
+            std::cerr << "error: failed to preload " << path << ": " << strerror(err) << std::endl;
+            return false;
+        }
+
+        static void copy_attributes(const entry::entry_ref& entry, const struct stat& info) {
+            entry->mode(info.st_mode & 07777);
+            entry->user(info.st_uid);
+            entry->group(info.st_gid);
+            entry->atime(info.st_atim);
+            entry->mtime(info.st_mtim);
+        }
+
+        // Create the entries of a directory and its subdirectories, regular
+        // files are only collected
+        static bool scan(const string& path, entry::dir_ptr dir, std::vector<pending_file>& files) {
+            DIR* handle = opendir(path.c_str());
+            if (!handle) return report(path, errno);
+
+            bool ok = true;
+
+            while (dirent* child = readdir(handle)) {
+                string name = child->d_name;
+                if (name == "." || name == "..") continue;
+
+                string child_path = path + "/" + name;
+
+                // Lookups would find the statistics directory instead
+                if (!dir->parent() && name == stats::dir_name) {
+                    std::cerr << "warning: skipped " << child_path << ", which the statistics directory would hide" << std::endl;
+                    continue;
+                }
+
+                struct stat info;
+                if (lstat(child_path.c_str(), &info) != 0) {
+                    ok = report(child_path, errno);
+                    break;
+                }
+
+                if (S_ISDIR(info.st_mode)) {
+                    auto subdir = entry::dir_t::make(dir, name);
+
+                    if (!scan(child_path, subdir.get(), files)) {
+                        ok = false;
+                        break;
+                    }
+
+                    // Adding the children changed the times
+                    copy_attributes(subdir, info);
+                } else if (S_ISLNK(info.st_mode)) {
+                    std::vector<char> target(info.st_size + 1);
+                    ssize_t length = readlink(child_path.c_str(), target.data(), target.size());
+
+                    if (length < 0) {
+                        ok = report(child_path, errno);
+                        break;
+                    }
+
+                    auto symlink = entry::symlink_t::make(dir, name, string(target.data(), length));
+                    copy_attributes(symlink, info);
+                } else if (S_ISREG(info.st_mode)) {
+                    files.push_back({entry::file_t::make(dir, name), child_path, info});
+                } else {
+                    std::cerr << "warning: skipped special file " << child_path << std::endl;
+                }
+            }
+
+            closedir(handle);
+
+            return ok;
+        }
+
+        // Read the contents of a file straight into the staging buffers of
+        // its writes, returns -error or 0
+        static int fill(const pending_file& pending) {
+            int fd = open(pending.path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return -errno;
+
+            int err = 0;
+
+            // Files that shrink while they're read fail with EIO
+            auto source = [&](char* dst, size_t size) {
+                while (size > 0) {
+                    ssize_t r = read(fd, dst, size);
+
+                    if (r < 0 && errno == EINTR) continue;
+                    if (r < 0) err = -errno;
+                    if (r <= 0) return false;
+
+                    dst += r;
+                    size -= r;
+                }
+
+                return true;
+            };
+
+            size_t size = pending.info.st_size;
+
+            for (size_t off = 0; off < size;) {
+                size_t part = std::min(memory::staging_size, size - off);
+
+                int r = pending.file->write(off, part, source);
+                if (r < 0) {
+                    if (err == 0) err = r;
+                    break;
+                }
+
+                off += part;
+            }
+
+            close(fd);
+
+            // Transfers of collected writes are started right away, the times
+            // are set last since writing changes them
+            pending.file->flush();
+            copy_attributes(pending.file, pending.info);
+
+            return err;
+        }
+
+        bool load(entry::dir_ptr root, const string& path) {
+            std::vector<pending_file> files;
+            if (!scan(path, root, files)) return false;
+
+            // Largest first, so that the threads finish at about the same time
+            std::sort(files.begin(), files.end(), [](const pending_file& a, const pending_file& b) {
+                return a.info.st_size > b.info.st_size;
+            });
+
+            std::atomic<size_t> next(0);
+            std::atomic<bool> failed(false);
+            std::mutex report_mutex;
+
+            std::vector<std::thread> threads;
+
+            for (size_t i = 0; i < std::min(thread_count, files.size()); i++) {
+                threads.emplace_back([&] {
+                    while (!failed) {
+                        size_t index = next++;
+                        if (index >= files.size()) break;
+
+                        int err = fill(files[index]);
+
+                        if (err != 0) {
+                            std::lock_guard<std::mutex> local_lock(report_mutex);
+                            if (!failed.exchange(true)) report(files[index].path, -err);
+                        }
+                    }
+                });
+            }
+
+            for (auto& thread : threads) {
+                thread.join();
+            }
+
+            return !failed;
+        }
+    }
+}
@@ -0,0 +1,405 @@
+#include "snapshot.hpp"
+#include "stats.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+
+namespace vram {
+    namespace snapshot {
+        // Images start with this, followed by the nodes of the tree from the
+        // root onwards. Numbers are stored in the byte order of the host.
+        //
+        // node: type (1 byte), name length (4), name, mode, user, group (4
+        // each), atime, mtime (8 each, nanoseconds), extended attribute count
+        // (4) and the name and value of each (with their lengths like the
+        // name), then for files the size
+        // (8) and extents of data that end with one of length 0, each with
+        // its offset and length (8 each) followed by the data, for symlinks
+        // the target length (4) and target, for directories nothing.
+        const char magic[8] = {'V', 'R', 'A', 'M', 'F', 'S', 0, 2};
+
+        // Files are copied and read in pieces of this size, the transfers of
+        // all blocks of a piece are issued at once
+        const size_t piece_size = 16 * 1024 * 1024;
+
+        static bool report(const string& error, const string& path) {
+            std::cerr << "error: " << error << " " << path << std::endl;
+            return false;
+        }
+
+        /*
+         * Capturing
+         */
+
+        static node describe(const entry::entry_ref& entry) {
+            node n;
+            n.type = entry->type();
+            n.name = entry->name();
+            n.mode = entry->mode();
+            n.user = entry->user();
+            n.group = entry->group();
+            n.atime = entry->atime();
+            n.mtime = entry->mtime();
+
+            string names = entry->xattr_names();
+
+            for (size_t pos = 0; pos < names.size();) {
+                size_t end = names.find('\0', pos);
+                string name = names.substr(pos, end - pos);
+
+                // May have been removed since it was listed
+                string value;
+                if (entry->xattr(name, value) == 0) n.xattrs.emplace_back(name, value);
+
+                pos = end + 1;
+            }
+
+            return n;
+        }
+
+        static bool capture_dir(entry::dir_t& dir, tree& nodes) {
+            std::vector<entry::entry_ref> children;
+
+            dir.list(0, [&](const entry::entry_ref& child) {
+                children.push_back(child);
+                return true;
+            });
+
+            for (auto& child : children) {
+                nodes.push_back(describe(child));
+                node& n = nodes.back();
+
+                if (n.type == entry::type::file) {
+                    n.file = util::dynamic_pointer_cast<entry::file_t>(child)->clone();
+                } else if (n.type == entry::type::symlink) {
+                    n.target = util::dynamic_pointer_cast<entry::symlink_t>(child)->target;
+                } else if (n.type == entry::type::dir) {
+                    if (!capture_dir(*util::dynamic_pointer_cast<entry::dir_t>(child), nodes)) return false;
+
+                    nodes.push_back(node());
+                    nodes.back().type = entry::type::none;
+                }
+            }
+
+            return true;
+        }
+
+        bool capture(entry::dir_ptr root, tree& nodes) {
+            nodes.clear();
+            nodes.push_back(describe(entry::entry_ref(root)));
+
+            bool ok = capture_dir(*root, nodes);
+
+            nodes.push_back(node());
+            nodes.back().type = entry::type::none;
+
+            if (!ok) nodes.clear();
+            return ok;
+        }
+
+        /*
+         * Saving
+         */
+
+        class writer {
+        public:
+            explicit writer(FILE* out) : out(out) {}
+
+            template<typename T>
+            void put(T value) {
+                bytes(&value, sizeof(value));
+            }
+
+            void bytes(const void* data, size_t size) {
+                if (ok && fwrite(data, 1, size, out) != size) ok = false;
+            }
+
+            void text(const string& s) {
+                put<uint32_t>(s.size());
+                bytes(s.data(), s.size());
+            }
+
+            bool ok = true;
+
+        private:
+            FILE* out;
+        };
+
+        static bool save_file(writer& out, entry::file_t& file, std::vector<char>& buffer) {
+            size_t size = file.size();
+            out.put<uint64_t>(size);
+
+            for (off_t off = 0; out.ok;) {
+                // Holes are left out of the image
+                off_t start = file.seek(off, SEEK_DATA);
+                if (start < 0) break;
+
+                off_t end = file.seek(start, SEEK_HOLE);
+                if (end < 0) end = size;
+
+                out.put<uint64_t>(start);
+                out.put<uint64_t>(end - start);
+
+                for (off_t pos = start; pos < end && out.ok;) {
+                    size_t part = std::min(piece_size, (size_t) (end - pos));
+
+                    if (file.read(pos, part, buffer.data()) != (int) part) return false;
+                    out.bytes(buffer.data(), part);
+
+                    pos += part;
+                }
+
+                off = end;
+            }
+
+            out.put<uint64_t>(0);
+            out.put<uint64_t>(0);
+
+            return out.ok;
+        }
+
+        bool save(const tree& nodes, const string& path) {
+            string temp_path = path + ".tmp";
+
+            FILE* file = fopen(temp_path.c_str(), "wb");
+            if (!file) return report("failed to create snapshot", temp_path);
+
+            writer out(file);
+            std::vector<char> buffer(piece_size);
+
+            out.bytes(magic, sizeof(magic));
+
+            for (auto& n : nodes) {
+                out.put<uint8_t>(n.type);
+                if (n.type == entry::type::none) continue;
+
+                out.text(n.name);
+                out.put<uint32_t>(n.mode);
+                out.put<uint32_t>(n.user);
+                out.put<uint32_t>(n.group);
+                out.put<int64_t>(util::to_nanoseconds(n.atime));
+                out.put<int64_t>(util::to_nanoseconds(n.mtime));
+
+                out.put<uint32_t>(n.xattrs.size());
+                for (auto& attr : n.xattrs) {
+                    out.text(attr.first);
+                    out.text(attr.second);
+                }
+
+                if (n.type == entry::type::file) {
+                    if (!save_file(out, *n.file, buffer)) out.ok = false;
+                } else if (n.type == entry::type::symlink) {
+                    out.text(n.target);
+                }
+            }
+
+            // The previous image is only replaced by a complete one
+            bool ok = out.ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+            ok = fclose(file) == 0 && ok;
+
+            if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+                unlink(temp_path.c_str());
+                return report("failed to write snapshot", path);
+            }
+
+            return true;
+        }
+
+        /*
+         * Restoring
+         */
+
+        class reader {
+        public:
+            reader(const char* data, size_t size) : pos(data), end(data + size) {}
+
+            template<typename T>
+            T get() {
+                T value = T();
+                const char* data = bytes(sizeof(value));
+                if (data) memcpy(&value, data, sizeof(value));
+                return value;
+            }
+
+            // Returns nullptr if the image ends before
+            const char* bytes(size_t size) {
+                if (!ok || (size_t) (end - pos) < size) {
+                    ok = false;
+                    return nullptr;
+                }
+
+                const char* data = pos;
+                pos += size;
+                return data;
+            }
+
+            string text() {
+                uint32_t size = get<uint32_t>();
+                const char* data = bytes(size);
+                return data ? string(data, size) : string();
+            }
+
+            bool ok = true;
+
+        private:
+            const char* pos;
+            const char* end;
+        };
+
+        // Everything but the type, returns false if the image ends before
+        static bool read_node(reader& in, node& n) {
+            n.name = in.text();
+            n.mode = in.get<uint32_t>();
+            n.user = in.get<uint32_t>();
+            n.group = in.get<uint32_t>();
+            n.atime = util::to_timespec(in.get<int64_t>());
+            n.mtime = util::to_timespec(in.get<int64_t>());
+
+            uint32_t xattr_count = in.get<uint32_t>();
+
+            for (uint32_t i = 0; i < xattr_count && in.ok; i++) {
+                string name = in.text();
+                n.xattrs.emplace_back(name, in.text());
+            }
+
+            return in.ok;
+        }
+
+        static void apply(const entry::entry_ref& entry, const node& n) {
+            for (auto& attr : n.xattrs) {
+                entry->xattr(attr.first, attr.second, 0);
+            }
+
+            entry->mode(n.mode);
+            entry->user(n.user);
+            entry->group(n.group);
+            entry->atime(n.atime);
+            entry->mtime(n.mtime);
+        }
+
+        // Returns 0, -ENOSPC if the data doesn't fit or -EINVAL if the image
+        // is invalid
+        static int restore_file(reader& in, entry::file_t& file) {
+            uint64_t size = in.get<uint64_t>();
+            if (size > (uint64_t) std::numeric_limits<off_t>::max()) return -EINVAL;
+
+            while (in.ok) {
+                uint64_t off = in.get<uint64_t>();
+                uint64_t length = in.get<uint64_t>();
+                if (length == 0) break;
+
+                const char* data = in.bytes(length);
+                if (!data || length > size || off > size - length) return -EINVAL;
+
+                // Written asynchronously, the data is copied out of the mapping
+                for (uint64_t done = 0; done < length;) {
+                    size_t part = std::min((uint64_t) piece_size, length - done);
+
+                    int r = file.write(off + done, part, data + done);
+                    if (r < 0) return r;
+
+                    done += part;
+                }
+            }
+
+            if (!in.ok) return -EINVAL;
+
+            file.size(size);
+            file.flush();
+
+            return 0;
+        }
+
+        static int restore_dir(reader& in, entry::dir_ptr root, entry::dir_ptr dir) {
+            while (true) {
+                auto type = (entry::type::type_t) in.get<uint8_t>();
+                if (!in.ok) return -EINVAL;
+                if (type == entry::type::none) return 0;
+
+                node n;
+
+                if (!read_node(in, n) || n.name.empty() || n.name.find('/') != string::npos) return -EINVAL;
+                if (n.name == "." || n.name == "..") return -EINVAL;
+
+                // Hidden by the statistics directory
+                if (dir == root && n.name == stats::dir_name) return -EINVAL;
+
+                entry::entry_ref existing;
+                if (dir->child(n.name, existing) == 0) return -EINVAL;
+
+                entry::entry_ref entry;
+                int err = 0;
+
+                if (type == entry::type::file) {
+                    auto file = entry::file_t::make(dir, n.name);
+                    err = restore_file(in, *file);
+                    entry = file;
+                } else if (type == entry::type::symlink) {
+                    string target = in.text();
+                    if (!in.ok) return -EINVAL;
+
+                    entry = entry::symlink_t::make(dir, n.name, target);
+                } else if (type == entry::type::dir) {
+                    auto subdir = entry::dir_t::make(dir, n.name);
+                    err = restore_dir(in, root, subdir.get());
+                    entry = subdir;
+                } else {
+                    return -EINVAL;
+                }
+
+                if (err != 0) return err;
+
+                // Times are set last, since filling the entry changes them
+                apply(entry, n);
+            }
+        }
+
+        bool restore(entry::dir_ptr root, const string& path) {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) return report("failed to open snapshot", path);
+
+            struct stat info;
+            void* image = MAP_FAILED;
+
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                image = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            }
+
+            close(fd);
+
+            if (image == MAP_FAILED) return report("failed to map snapshot", path);
+
+            // Read once from start to end
+            madvise(image, info.st_size, MADV_SEQUENTIAL);
+
+            reader in(reinterpret_cast<const char*>(image), info.st_size);
+            int err = -EINVAL;
+
+            const char* header = in.bytes(sizeof(magic));
+
+            if (header && memcmp(header, magic, sizeof(magic)) == 0 && in.get<uint8_t>() == entry::type::dir) {
+                node n;
+
+                if (read_node(in, n)) err = restore_dir(in, root, root);
+                if (err == 0) apply(entry::entry_ref(root), n);
+            }
+
+            munmap(image, info.st_size);
+
+            if (err == -ENOSPC) return report("not enough space to restore", path);
+            if (err != 0) return report("invalid snapshot", path);
+
+            return true;
+        }
+    }
+}
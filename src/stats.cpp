@@ -0,0 +1,154 @@
+#include "stats.hpp"
+#include "memory.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+namespace vram {
+    namespace stats {
+        // Latencies are counted in buckets of powers of two microseconds, the
+        // first bucket holds everything below 1 us
+        const int bucket_count = 32;
+
+        struct histogram {
+            std::atomic<uint64_t> count;
+            std::atomic<uint64_t> total_ns;
+            std::atomic<uint64_t> max_ns;
+            std::atomic<uint64_t> buckets[bucket_count];
+
+            void add(uint64_t ns) {
+                count.fetch_add(1, std::memory_order_relaxed);
+                total_ns.fetch_add(ns, std::memory_order_relaxed);
+
+                uint64_t max = max_ns.load(std::memory_order_relaxed);
+                while (ns > max && !max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed));
+
+                int bucket = 0;
+                for (uint64_t us = ns / 1000; us > 0 && bucket < bucket_count - 1; us >>= 1) bucket++;
+
+                buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // Upper bound of the bucket that contains the given fraction of
+            // all samples, in microseconds
+            uint64_t percentile(double fraction) const {
+                uint64_t total = count.load(std::memory_order_relaxed);
+                uint64_t max_us = max_ns.load(std::memory_order_relaxed) / 1000;
+                uint64_t seen = 0;
+
+                for (int i = 0; i < bucket_count; i++) {
+                    seen += buckets[i].load(std::memory_order_relaxed);
+                    if (seen > 0 && seen >= fraction * total) return std::min<uint64_t>(1ULL << i, max_us + 1);
+                }
+
+                return max_us + 1;
+            }
+        };
+
+        // Zero-initialised as globals
+        histogram op_latency[op::count];
+        std::atomic<uint64_t> counters[counter::count];
+
+        histogram shared_lock_wait;
+        histogram exclusive_lock_wait;
+
+        histogram transfer_queued[2];
+        histogram transfer_run[2];
+
+        const char* op_names[op::count] = {
+            "lookup", "forget", "getattr", "setattr", "readlink", "setxattr",
+            "getxattr", "listxattr", "removexattr", "opendir", "readdir",
+            "create", "mkdir", "symlink", "unlink", "rmdir", "rename", "open",
+            "read", "write", "fsync", "flush", "fallocate", "copy_file_range",
+            "lseek", "release", "statfs"
+        };
+
+        const char* counter_names[counter::count] = {
+            "bytes_read", "bytes_written", "bytes_from_device", "bytes_to_device",
+            "bytes_copied", "bytes_zero", "bytes_deduplicated",
+            "cache_hits", "cache_misses", "blocks_evicted", "blocks_loaded",
+            "writes_throttled", "prefetches_dropped"
+        };
+
+        static uint64_t nanoseconds_since(clock::time_point start) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+        }
+
+        void record(op::op_t op, clock::time_point start) {
+            op_latency[op].add(nanoseconds_since(start));
+        }
+
+        void add(counter::counter_t counter, uint64_t n) {
+            counters[counter].fetch_add(n, std::memory_order_relaxed);
+        }
+
+        void lock_wait(clock::time_point start, bool exclusive) {
+            (exclusive ? exclusive_lock_wait : shared_lock_wait).add(nanoseconds_since(start));
+        }
+
+        void transfer(bool to_device, uint64_t queued_ns, uint64_t run_ns) {
+            transfer_queued[to_device].add(queued_ns);
+            transfer_run[to_device].add(run_ns);
+        }
+
+        // Line of the latency table
+        static void print_histogram(string& out, const char* name, const histogram& h) {
+            uint64_t count = h.count.load(std::memory_order_relaxed);
+            if (count == 0) return;
+
+            uint64_t total_us = h.total_ns.load(std::memory_order_relaxed) / 1000;
+
+            char line[256];
+            snprintf(line, sizeof(line), "%-24s %12llu %14llu %10llu %10llu %10llu %10llu %12llu\n", name,
+                (unsigned long long) count, (unsigned long long) total_us,
+                (unsigned long long) (total_us / count),
+                (unsigned long long) h.percentile(0.5), (unsigned long long) h.percentile(0.9),
+                (unsigned long long) h.percentile(0.99),
+                (unsigned long long) (h.max_ns.load(std::memory_order_relaxed) / 1000));
+
+            out += line;
+        }
+
+        static void print_value(string& out, const char* name, uint64_t value) {
+            char line[128];
+            snprintf(line, sizeof(line), "%-24s %llu\n", name, (unsigned long long) value);
+            out += line;
+        }
+
+        string report() {
+            string out;
+
+            char header[256];
+            snprintf(header, sizeof(header), "%-24s %12s %14s %10s %10s %10s %10s %12s\n",
+                "latency", "count", "total_us", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+            out += header;
+
+            for (int i = 0; i < op::count; i++) {
+                print_histogram(out, op_names[i], op_latency[i]);
+            }
+
+            print_histogram(out, "lock_shared_wait", shared_lock_wait);
+            print_histogram(out, "lock_exclusive_wait", exclusive_lock_wait);
+
+            print_histogram(out, "from_device_queued", transfer_queued[0]);
+            print_histogram(out, "from_device_run", transfer_run[0]);
+            print_histogram(out, "to_device_queued", transfer_queued[1]);
+            print_histogram(out, "to_device_run", transfer_run[1]);
+
+            out += "\n";
+
+            for (int i = 0; i < counter::count; i++) {
+                print_value(out, counter_names[i], counters[i].load(std::memory_order_relaxed));
+            }
+
+            out += "\n";
+
+            print_value(out, "pool_size", memory::pool_size());
+            print_value(out, "pool_allocated", memory::pool_allocated());
+            print_value(out, "pool_available", memory::pool_available());
+
+            return out;
+        }
+    }
+}
@@ -1,5 +1,9 @@
 #include "util.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
 namespace vram {
     namespace util {
         timespec time() {
@@ -8,6 +12,26 @@ namespace vram {
             return tv;
         }
 
+        int64_t to_nanoseconds(timespec t) {
+            const int64_t max_sec = std::numeric_limits<int64_t>::max() / 1000000000LL - 1;
+            int64_t sec = std::max<int64_t>(-max_sec, std::min<int64_t>(max_sec, t.tv_sec));
+
+            return sec * 1000000000LL + t.tv_nsec;
+        }
+
+        timespec to_timespec(int64_t t) {
+            timespec tv;
+            tv.tv_sec = t / 1000000000LL;
+            tv.tv_nsec = t % 1000000000LL;
+
+            if (tv.tv_nsec < 0) {
+                tv.tv_sec--;
+                tv.tv_nsec += 1000000000LL;
+            }
+
+            return tv;
+        }
+
         void split_file_path(const string& path, string& dir, string& file) {
             size_t p = path.rfind("/");
 
@@ -21,5 +45,141 @@ namespace vram {
 
             if (dir.size() == 0) dir = "/";
         }
+
+        bool is_zero(const char* data, size_t size) {
+            // Comparing the data with itself shifted by one byte stops at the
+            // first difference, which is usually right at the start
+            return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+        }
+
+        static uint64_t rotl(uint64_t x, int r) {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        static uint64_t mix(uint64_t k) {
+            k ^= k >> 33;
+            k *= 0xff51afd7ed558ccdULL;
+            k ^= k >> 33;
+            k *= 0xc4ceb9fe1a85ec53ULL;
+            k ^= k >> 33;
+            return k;
+        }
+
+        // MurmurHash3 (x64, 128-bit) by Austin Appleby, which is in the public domain
+        static const uint64_t c1 = 0x87c37b91114253d5ULL;
+        static const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+        // Mix in data that consists of whole 16 byte parts
+        static void hash_body(uint64_t& h1, uint64_t& h2, const char* data, size_t body) {
+            for (size_t i = 0; i < body; i += 16) {
+                uint64_t k1, k2;
+                memcpy(&k1, data + i, 8);
+                memcpy(&k2, data + i + 8, 8);
+
+                h1 ^= rotl(k1 * c1, 31) * c2;
+                h1 = (rotl(h1, 27) + h2) * 5 + 0x52dce729;
+
+                h2 ^= rotl(k2 * c2, 33) * c1;
+                h2 = (rotl(h2, 31) + h1) * 5 + 0x38495ab5;
+            }
+        }
+
+        // Mix in the last size % 16 bytes and the size
+        static hash128 hash_tail(uint64_t h1, uint64_t h2, const char* tail, uint64_t size) {
+            uint64_t k1 = 0;
+            uint64_t k2 = 0;
+
+            for (size_t i = 0; i < size % 16; i++) {
+                uint64_t byte = (unsigned char) tail[i];
+
+                if (i < 8) {
+                    k1 |= byte << (8 * i);
+                } else {
+                    k2 |= byte << (8 * (i - 8));
+                }
+            }
+
+            if (size % 16 > 8) h2 ^= rotl(k2 * c2, 33) * c1;
+            if (size % 16 > 0) h1 ^= rotl(k1 * c1, 31) * c2;
+
+            h1 ^= size;
+            h2 ^= size;
+
+            h1 += h2;
+            h2 += h1;
+
+            h1 = mix(h1);
+            h2 = mix(h2);
+
+            h1 += h2;
+            h2 += h1;
+
+            return {h1, h2};
+        }
+
+        hash128 hash(const char* data, size_t size) {
+            uint64_t h1 = 0;
+            uint64_t h2 = 0;
+
+            size_t body = size - size % 16;
+            hash_body(h1, h2, data, body);
+
+            return hash_tail(h1, h2, data + body, size);
+        }
+
+        void hasher::add(const char* data, size_t size) {
+            size_t used = length % 16;
+            length += size;
+
+            // Complete the part left over from before
+            if (used > 0) {
+                size_t part = std::min(16 - used, size);
+                memcpy(tail + used, data, part);
+
+                data += part;
+                size -= part;
+
+                if (used + part < 16) return;
+                hash_body(h1, h2, tail, 16);
+            }
+
+            size_t body = size - size % 16;
+            hash_body(h1, h2, data, body);
+
+            memcpy(tail, data + body, size - body);
+        }
+
+        hash128 hasher::result() const {
+            return hash_tail(h1, h2, tail, length);
+        }
+
+        rwlock::rwlock() {
+            // Prevent a steady stream of readers from starving writers
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+            pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+            pthread_rwlock_init(&handle, &attr);
+            pthread_rwlockattr_destroy(&attr);
+        }
+
+        rwlock::~rwlock() {
+            pthread_rwlock_destroy(&handle);
+        }
+
+        void rwlock::lock() {
+            pthread_rwlock_wrlock(&handle);
+        }
+
+        void rwlock::unlock() {
+            pthread_rwlock_unlock(&handle);
+        }
+
+        void rwlock::lock_shared() {
+            pthread_rwlock_rdlock(&handle);
+        }
+
+        void rwlock::unlock_shared() {
+            pthread_rwlock_unlock(&handle);
+        }
     }
 }
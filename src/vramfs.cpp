@@ -1,18 +1,28 @@
 // Third-party libraries
 #define FUSE_USE_VERSION 30
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <unistd.h>
 
 // Standard library
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 #include <cstdint>
 #include <limits>
 #include <regex>
+#include <sstream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <sys/mman.h>
 
 // Internal dependencies
 #include "vramfs.hpp"
+#include "preload.hpp"
+#include "snapshot.hpp"
+#include "stats.hpp"
 
 using namespace vram;
 
@@ -20,65 +30,145 @@ using namespace vram;
  * Globals
  */
 
-// Lock to prevent multiple threads from manipulating the file system index and
-// OpenCL buffers simultaneously. The tiny overhead is worth not having to deal
-// with the uncountable amount of race conditions that would otherwise occur.
-static std::mutex fsmutex;
+// Lock on the file system namespace (directory children and entry names).
+// Lookups take it shared, operations that add, remove or move entries take it
+// exclusively. File contents are protected by locks in the file entries
+// themselves, so reads and writes through a file session don't need it.
+static util::rwlock fslock;
+
+// Scoped shared and exclusive ownership of the namespace lock, which record
+// how long they had to wait for it
+class fs_shared_lock {
+public:
+    fs_shared_lock() {
+        auto start = stats::clock::now();
+        fslock.lock_shared();
+        stats::lock_wait(start, false);
+    }
+
+    fs_shared_lock(const fs_shared_lock& other) = delete;
+
+    ~fs_shared_lock() {
+        fslock.unlock_shared();
+    }
+};
+
+class fs_exclusive_lock {
+public:
+    fs_exclusive_lock() {
+        auto start = stats::clock::now();
+        fslock.lock();
+        stats::lock_wait(start, true);
+    }
+
+    fs_exclusive_lock(const fs_exclusive_lock& other) = delete;
+
+    ~fs_exclusive_lock() {
+        fslock.unlock();
+    }
+};
 
 // File system root that links to the rest
 static entry::dir_ref root_entry;
 
+// Entries known to the kernel by their inode number, with the number of
+// lookups that it hasn't forgotten yet. They're kept alive until then, even if
+// they're unlinked. The root directory is never forgotten, so it isn't in here.
+struct inode_t {
+    entry::entry_ref entry;
+    uint64_t lookups;
+};
+
+static std::mutex inode_mutex;
+static std::unordered_map<fuse_ino_t, inode_t> inodes;
+
+// All changes go through the kernel, so it can cache names and attributes
+static const double entry_timeout = 1.0;
+static const double attr_timeout = 1.0;
+
+// Amount of data to prefetch ahead of sequential reads
+static const size_t read_ahead = 1024 * 1024;
+
+// Preferred size of reads and writes reported to applications
+static const size_t io_size = 128 * 1024;
+
+// Every file behaves as if it was opened with O_DIRECT and bypasses the page cache
+static bool direct_io = false;
+
+// Read-only directory in the root with a file that reports the statistics,
+// neither is part of the entry tree or shows up in the listing of the root
+static const fuse_ino_t stats_dir_ino = std::numeric_limits<fuse_ino_t>::max() - 1;
+static const fuse_ino_t stats_file_ino = std::numeric_limits<fuse_ino_t>::max() - 2;
+
+static const char* stats_file_name = "stats";
+
 /*
- * Initialisation
+ * Inodes
  */
 
-static void* vram_init(fuse_conn_info* conn, fuse_config*) {
-    root_entry = entry::dir_t::make(nullptr, "");
-    root_entry->user(geteuid());
-    root_entry->group(getegid());
+static fuse_ino_t inode_number(const entry::entry_ref& entry) {
+    return entry == root_entry ? FUSE_ROOT_ID : entry->ino();
+}
 
-    std::cout << "mounted." << std::endl;
+// Look up entry that the kernel refers to by inode number
+static entry::entry_ref get_entry(fuse_ino_t ino) {
+    if (ino == FUSE_ROOT_ID) return root_entry;
+
+    lock_guard<mutex> local_lock(inode_mutex);
 
-    return nullptr;
+    auto it = inodes.find(ino);
+    return it != inodes.end() ? it->second.entry : nullptr;
 }
 
-/*
- * File system info
- */
+// Count a lookup of the entry by the kernel, which happens for every entry
+// that is replied to a lookup, create or readdirplus request
+static void remember(const entry::entry_ref& entry) {
+    if (entry == root_entry) return;
 
-static int vram_statfs(const char*, struct statvfs* vfs) {
-    vfs->f_bsize = memory::block::size;
-    vfs->f_blocks = memory::pool_size();
-    vfs->f_bfree = memory::pool_available();
-    vfs->f_bavail = memory::pool_available();
-    vfs->f_files = entry::count();
-    vfs->f_ffree = std::numeric_limits<fsfilcnt_t>::max();
-    vfs->f_namemax = std::numeric_limits<unsigned long>::max();
+    lock_guard<mutex> local_lock(inode_mutex);
 
-    return 0;
+    auto& inode = inodes[entry->ino()];
+    inode.entry = entry;
+    inode.lookups++;
+}
+
+static void forget(fuse_ino_t ino, uint64_t lookups) {
+    if (ino == FUSE_ROOT_ID) return;
+
+    entry::entry_ref entry;
+
+    {
+        lock_guard<mutex> local_lock(inode_mutex);
+
+        auto it = inodes.find(ino);
+        if (it == inodes.end()) return;
+
+        it->second.lookups -= std::min(lookups, it->second.lookups);
+
+        // Entry is destroyed after unlocking, since that may free its blocks
+        if (it->second.lookups == 0) {
+            entry = it->second.entry;
+            inodes.erase(it);
+        }
+    }
 }
 
 /*
  * Entry attributes
  */
 
-static int vram_getattr(const char* path, struct stat* stbuf, fuse_file_info*) {
-    lock_guard<mutex> local_lock(fsmutex);
-
-    // Look up entry
-    entry::entry_ref entry;
-    int err = root_entry->find(path, entry);
-    if (err != 0) return err;
-
+static void get_attr(const entry::entry_ref& entry, struct stat* stbuf) {
     memset(stbuf, 0, sizeof(struct stat));
 
+    stbuf->st_ino = inode_number(entry);
+
     if (entry->type() == entry::type::dir) {
         stbuf->st_mode = S_IFDIR | entry->mode();
         stbuf->st_nlink = 2;
     } else if (entry->type() == entry::type::file) {
         stbuf->st_mode = S_IFREG | entry->mode();
         stbuf->st_nlink = 1;
-        stbuf->st_blksize = memory::block::size;
+        stbuf->st_blksize = io_size;
 
         if (entry->size() > 0) {
             stbuf->st_blocks = 1 + (entry->size() - 1) / 512; // man 2 stat
@@ -94,361 +184,948 @@ static int vram_getattr(const char* path, struct stat* stbuf, fuse_file_info*) {
     stbuf->st_atim = entry->atime();
     stbuf->st_mtim = entry->mtime();
     stbuf->st_ctim = entry->ctime();
+}
+
+// Description of an entry for the kernel, which doesn't count as a lookup yet
+static fuse_entry_param entry_param(const entry::entry_ref& entry) {
+    fuse_entry_param param;
+    memset(&param, 0, sizeof(param));
+
+    param.ino = inode_number(entry);
+    param.attr_timeout = attr_timeout;
+    param.entry_timeout = entry_timeout;
+    get_attr(entry, &param.attr);
+
+    return param;
+}
+
+// Reply with a found or created entry
+static void reply_entry(fuse_req_t req, const entry::entry_ref& entry) {
+    auto param = entry_param(entry);
+    remember(entry);
+    fuse_reply_entry(req, &param);
+}
+
+static int err_reply(fuse_req_t req, int err) {
+    return fuse_reply_err(req, -err);
+}
+
+// New entries belong to the user that created them
+static void set_owner(fuse_req_t req, const entry::entry_ref& entry) {
+    auto context = fuse_req_ctx(req);
+    entry->user(context->uid);
+    entry->group(context->gid);
+}
+
+// Assign a new file handle to *fi*
+static void open_session(fuse_file_info* fi, const entry::file_ref& file) {
+    // The kernel keeps the page cache coherent with O_DIRECT handles itself
+    fi->fh = reinterpret_cast<uint64_t>(new file_session(file, direct_io || (fi->flags & O_DIRECT)));
+    fi->direct_io = direct_io;
+
+    // Nothing changes the file behind the back of the kernel, so the data
+    // it has cached stays valid between opens
+    fi->keep_cache = !direct_io;
+}
+
+// Look up the parent directory of a new or removed entry
+static int get_dir(fuse_ino_t ino, entry::dir_ref& dir) {
+    if (ino == stats_dir_ino) return -EPERM;
+
+    auto entry = get_entry(ino);
+    if (!entry) return -ENOENT;
+    if (entry->type() != entry::type::dir) return -ENOTDIR;
+
+    dir = dynamic_pointer_cast<entry::dir_t>(entry);
 
     return 0;
 }
 
 /*
- * Get target of link
+ * Statistics
  */
 
-static int vram_readlink(const char* path, char* buf, size_t size) {
-    lock_guard<mutex> local_lock(fsmutex);
+static bool is_stats(fuse_ino_t ino) {
+    return ino == stats_dir_ino || ino == stats_file_ino;
+}
 
-    entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::symlink);
-    if (err != 0) return err;
+// Name of the statistics directory can't be used by entries
+static bool is_stats_name(fuse_ino_t parent, const char* name) {
+    return parent == FUSE_ROOT_ID && strcmp(name, stats::dir_name) == 0;
+}
 
-    auto symlink = dynamic_pointer_cast<entry::symlink_t>(entry);
-    strncpy(buf, symlink->target.c_str(), size);
+// The statistics belong to the owner of the root and exist since mounting
+static void get_stats_attr(fuse_ino_t ino, struct stat* stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
 
-    return 0;
+    stbuf->st_ino = ino;
+
+    if (ino == stats_dir_ino) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+    }
+
+    stbuf->st_uid = root_entry->user();
+    stbuf->st_gid = root_entry->group();
+    stbuf->st_atim = root_entry->ctime();
+    stbuf->st_mtim = root_entry->ctime();
+    stbuf->st_ctim = root_entry->ctime();
+}
+
+static fuse_entry_param stats_entry_param(fuse_ino_t ino) {
+    fuse_entry_param param;
+    memset(&param, 0, sizeof(param));
+
+    param.ino = ino;
+    param.attr_timeout = attr_timeout;
+    param.entry_timeout = entry_timeout;
+    get_stats_attr(ino, &param.attr);
+
+    return param;
+}
+
+// Look up a name in the root or the statistics directory, returns false if it
+// isn't part of the statistics
+static bool lookup_stats(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    fuse_entry_param param;
+
+    if (is_stats_name(parent, name)) {
+        param = stats_entry_param(stats_dir_ino);
+    } else if (parent == stats_dir_ino) {
+        if (strcmp(name, stats_file_name) == 0) {
+            param = stats_entry_param(stats_file_ino);
+        } else {
+            memset(&param, 0, sizeof(param));
+            param.entry_timeout = entry_timeout;
+        }
+    } else {
+        return false;
+    }
+
+    fuse_reply_entry(req, &param);
+
+    return true;
+}
+
+// Listing of the statistics directory, which never changes
+static void read_stats_dir(fuse_req_t req, size_t size, off_t off, bool plus) {
+    const char* names[] = {".", "..", stats_file_name};
+    const fuse_ino_t inos[] = {stats_dir_ino, FUSE_ROOT_ID, stats_file_ino};
+
+    std::unique_ptr<char[]> buf(new char[size]);
+    size_t used = 0;
+
+    for (off_t i = off; i < 3; i++) {
+        size_t entry_size;
+
+        if (inos[i] == FUSE_ROOT_ID) {
+            auto param = entry_param(root_entry);
+
+            if (plus) entry_size = fuse_add_direntry_plus(req, buf.get() + used, size - used, names[i], &param, i + 1);
+            else entry_size = fuse_add_direntry(req, buf.get() + used, size - used, names[i], &param.attr, i + 1);
+        } else {
+            auto param = stats_entry_param(inos[i]);
+
+            if (plus) entry_size = fuse_add_direntry_plus(req, buf.get() + used, size - used, names[i], &param, i + 1);
+            else entry_size = fuse_add_direntry(req, buf.get() + used, size - used, names[i], &param.attr, i + 1);
+        }
+
+        if (entry_size > size - used) break;
+        used += entry_size;
+    }
+
+    fuse_reply_buf(req, buf.get(), used);
+}
+
+// Report is taken when the file is opened, so it's consistent between reads
+static void open_stats(fuse_req_t req, fuse_file_info* fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return (void) err_reply(req, -EACCES);
+
+    fi->fh = reinterpret_cast<uint64_t>(new string(stats::report()));
+
+    // Size is reported as 0, so reads must not be limited by it
+    fi->direct_io = 1;
+
+    fuse_reply_open(req, fi);
+}
+
+static void read_stats(fuse_req_t req, size_t size, off_t off, fuse_file_info* fi) {
+    auto report = reinterpret_cast<string*>(fi->fh);
+
+    if (off >= (off_t) report->size()) {
+        fuse_reply_buf(req, nullptr, 0);
+    } else {
+        fuse_reply_buf(req, report->data() + off, std::min(size, report->size() - off));
+    }
 }
 
 /*
- * Set the mode bits of an entry
+ * Initialisation
  */
 
-static int vram_chmod(const char* path, mode_t mode, fuse_file_info*) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_init(void*, fuse_conn_info* conn) {
+    // Let written data arrive in a pipe, so it can be read straight into
+    // the staging memory, and splice read replies into the kernel
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
 
-    entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::file | entry::type::dir);
-    if (err != 0) return err;
+    // Directory listings include the attributes of entries
+    conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
 
-    entry->mode(mode);
+    std::cout << "mounted." << std::endl;
+}
 
-    return 0;
+/*
+ * File system info
+ */
+
+static void vram_statfs(fuse_req_t req, fuse_ino_t) {
+    stats::timer timer(stats::op::statfs);
+
+    struct statvfs vfs;
+    memset(&vfs, 0, sizeof(vfs));
+
+    // Space is reported in units of the smallest block size
+    size_t unit = memory::class_size(0);
+
+    vfs.f_bsize = unit;
+    vfs.f_frsize = unit;
+    vfs.f_blocks = memory::pool_size() / unit;
+    vfs.f_bfree = memory::pool_available() / unit;
+    vfs.f_bavail = memory::pool_available() / unit;
+    vfs.f_files = entry::count();
+    vfs.f_ffree = std::numeric_limits<fsfilcnt_t>::max();
+    vfs.f_namemax = std::numeric_limits<unsigned long>::max();
+
+    fuse_reply_statfs(req, &vfs);
 }
 
 /*
- * Change the owner/group of an entry
+ * Find entry by name
  */
 
-static int vram_chown(const char* path, uid_t user, gid_t group, fuse_file_info*) {
-    lock_guard<mutex> lock_lock(fsmutex);
+static void vram_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    stats::timer timer(stats::op::lookup);
+    fs_shared_lock local_lock;
+
+    if (lookup_stats(req, parent, name)) return;
+
+    entry::dir_ref dir;
+    int err = get_dir(parent, dir);
+    if (err != 0) return (void) err_reply(req, err);
 
     entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::file | entry::type::dir);
-    if (err != 0) return err;
+    err = dir->child(name, entry);
 
-    entry->user(user);
-    entry->group(group);
+    if (err == -ENOENT) {
+        // The kernel caches that there is no such entry as well
+        fuse_entry_param param;
+        memset(&param, 0, sizeof(param));
+        param.entry_timeout = entry_timeout;
 
-    return 0;
+        fuse_reply_entry(req, &param);
+    } else if (err != 0) {
+        err_reply(req, err);
+    } else {
+        reply_entry(req, entry);
+    }
+}
+
+static void vram_forget(fuse_req_t req, fuse_ino_t ino, uint64_t lookups) {
+    stats::timer timer(stats::op::forget);
+
+    forget(ino, lookups);
+    fuse_reply_none(req);
+}
+
+static void vram_forget_multi(fuse_req_t req, size_t count, fuse_forget_data* forgets) {
+    stats::timer timer(stats::op::forget);
+
+    for (size_t i = 0; i < count; i++) {
+        forget(forgets[i].ino, forgets[i].nlookup);
+    }
+
+    fuse_reply_none(req);
+}
+
+static void vram_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info*) {
+    stats::timer timer(stats::op::getattr);
+    fs_shared_lock local_lock;
+
+    struct stat stbuf;
+
+    if (is_stats(ino)) {
+        get_stats_attr(ino, &stbuf);
+        return (void) fuse_reply_attr(req, &stbuf, attr_timeout);
+    }
+
+    auto entry = get_entry(ino);
+    if (!entry) return (void) err_reply(req, -ENOENT);
+
+    get_attr(entry, &stbuf);
+
+    fuse_reply_attr(req, &stbuf, attr_timeout);
 }
 
 /*
- * Set the last access and last modified times of an entry
+ * Change the mode, owner, size or times of an entry
  */
 
-static int vram_utimens(const char* path, const timespec tv[2], fuse_file_info*) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, fuse_file_info*) {
+    stats::timer timer(stats::op::setattr);
+    fs_shared_lock local_lock;
 
-    entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::file | entry::type::dir);
-    if (err != 0) return err;
+    if (is_stats(ino)) return (void) err_reply(req, -EPERM);
 
-    entry->atime(tv[0]);
-    entry->mtime(tv[1]);
+    auto entry = get_entry(ino);
+    if (!entry) return (void) err_reply(req, -ENOENT);
 
-    return 0;
+    // Symlinks don't have attributes of their own
+    if (entry->type() == entry::type::symlink) return (void) err_reply(req, -EPERM);
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (entry->type() != entry::type::file) return (void) err_reply(req, -EISDIR);
+
+        int err = dynamic_pointer_cast<entry::file_t>(entry)->size(attr->st_size);
+        if (err) return (void) err_reply(req, err);
+    }
+
+    if (to_set & FUSE_SET_ATTR_MODE) entry->mode(attr->st_mode & 07777);
+    if (to_set & FUSE_SET_ATTR_UID) entry->user(attr->st_uid);
+    if (to_set & FUSE_SET_ATTR_GID) entry->group(attr->st_gid);
+
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) entry->atime(util::time());
+    else if (to_set & FUSE_SET_ATTR_ATIME) entry->atime(attr->st_atim);
+
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) entry->mtime(util::time());
+    else if (to_set & FUSE_SET_ATTR_MTIME) entry->mtime(attr->st_mtim);
+
+    struct stat stbuf;
+    get_attr(entry, &stbuf);
+
+    fuse_reply_attr(req, &stbuf, attr_timeout);
+}
+
+/*
+ * Get target of link
+ */
+
+static void vram_readlink(fuse_req_t req, fuse_ino_t ino) {
+    stats::timer timer(stats::op::readlink);
+    fs_shared_lock local_lock;
+
+    auto entry = get_entry(ino);
+    if (!entry) return (void) err_reply(req, -ENOENT);
+    if (entry->type() != entry::type::symlink) return (void) err_reply(req, -EINVAL);
+
+    auto symlink = dynamic_pointer_cast<entry::symlink_t>(entry);
+    fuse_reply_readlink(req, symlink->target.c_str());
+}
+
+/*
+ * Extended attributes
+ */
+
+// POSIX ACLs are stored as system attributes, which would be shown but not
+// enforced, so that namespace isn't supported
+static bool is_system_xattr(const char* name) {
+    return strncmp(name, "system.", 7) == 0;
+}
+
+// Reply with the size of the value if the caller asks for it with a size of 0,
+// or with the value itself if it fits
+static void reply_xattr(fuse_req_t req, const string& value, size_t size) {
+    if (size == 0) {
+        fuse_reply_xattr(req, value.size());
+    } else if (value.size() > size) {
+        err_reply(req, -ERANGE);
+    } else {
+        fuse_reply_buf(req, value.data(), value.size());
+    }
+}
+
+static void vram_setxattr(fuse_req_t req, fuse_ino_t ino, const char* name, const char* value, size_t size, int flags) {
+    stats::timer timer(stats::op::setxattr);
+    fs_shared_lock local_lock;
+
+    if (is_stats(ino)) return (void) err_reply(req, -EPERM);
+    if (is_system_xattr(name)) return (void) err_reply(req, -EOPNOTSUPP);
+
+    auto entry = get_entry(ino);
+    if (!entry) return (void) err_reply(req, -ENOENT);
+
+    err_reply(req, entry->xattr(name, string(value, size), flags));
+}
+
+static void vram_getxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size) {
+    stats::timer timer(stats::op::getxattr);
+    fs_shared_lock local_lock;
+
+    if (is_stats(ino)) return (void) err_reply(req, -ENODATA);
+    if (is_system_xattr(name)) return (void) err_reply(req, -EOPNOTSUPP);
+
+    auto entry = get_entry(ino);
+    if (!entry) return (void) err_reply(req, -ENOENT);
+
+    string value;
+    int err = entry->xattr(name, value);
+    if (err) return (void) err_reply(req, err);
+
+    reply_xattr(req, value, size);
+}
+
+static void vram_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    stats::timer timer(stats::op::listxattr);
+    fs_shared_lock local_lock;
+
+    if (is_stats(ino)) return reply_xattr(req, "", size);
+
+    auto entry = get_entry(ino);
+    if (!entry) return (void) err_reply(req, -ENOENT);
+
+    reply_xattr(req, entry->xattr_names(), size);
+}
+
+static void vram_removexattr(fuse_req_t req, fuse_ino_t ino, const char* name) {
+    stats::timer timer(stats::op::removexattr);
+    fs_shared_lock local_lock;
+
+    if (is_stats(ino)) return (void) err_reply(req, -EPERM);
+    if (is_system_xattr(name)) return (void) err_reply(req, -EOPNOTSUPP);
+
+    auto entry = get_entry(ino);
+    if (!entry) return (void) err_reply(req, -ENOENT);
+
+    err_reply(req, entry->remove_xattr(name));
 }
 
 /*
  * Directory listing
  */
 
-static int vram_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t, fuse_file_info*, fuse_readdir_flags) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+    stats::timer timer(stats::op::opendir);
+    fs_shared_lock local_lock;
 
-    // Look up directory
-    entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::dir);
-    if (err != 0) return err;
-    auto dir = dynamic_pointer_cast<entry::dir_t>(entry);
+    if (ino == stats_dir_ino) return (void) fuse_reply_open(req, fi);
+
+    entry::dir_ref dir;
+    int err = get_dir(ino, dir);
+    if (err != 0) return (void) err_reply(req, err);
+
+    fuse_reply_open(req, fi);
+}
 
-    // Required default entries
-    filler(buf, ".", nullptr, 0, FUSE_FILL_DIR_PLUS);
-    filler(buf, "..", nullptr, 0, FUSE_FILL_DIR_PLUS);
+// Offsets of the default entries, those of children follow their inode number
+static const off_t dot_offset = 1;
+static const off_t dotdot_offset = 2;
+
+// Fill reply buffer with as many entries as fit, continuing after the entry
+// at *off*, and with their attributes for readdirplus
+//
+// Children are streamed straight from the directory instead of taking a copy
+// of the listing, because the offsets stay valid if it changes in between.
+static void read_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, bool plus) {
+    fs_shared_lock local_lock;
+
+    if (ino == stats_dir_ino) return read_stats_dir(req, size, off, plus);
+
+    entry::dir_ref dir;
+    int err = get_dir(ino, dir);
+    if (err != 0) return (void) err_reply(req, err);
+
+    std::unique_ptr<char[]> buf(new char[size]);
+    size_t used = 0;
+
+    // Returns false once the buffer is full
+    auto add = [&] (const char* name, const entry::entry_ref& entry, off_t entry_off) {
+        size_t entry_size;
+
+        if (plus) {
+            auto param = entry_param(entry);
+            entry_size = fuse_add_direntry_plus(req, buf.get() + used, size - used, name, &param, entry_off);
+        } else {
+            struct stat stbuf;
+            memset(&stbuf, 0, sizeof(stbuf));
+            stbuf.st_ino = inode_number(entry);
+            stbuf.st_mode = entry->type() == entry::type::dir ? S_IFDIR :
+                entry->type() == entry::type::file ? S_IFREG : S_IFLNK;
+
+            entry_size = fuse_add_direntry(req, buf.get() + used, size - used, name, &stbuf, entry_off);
+        }
+
+        if (entry_size > size - used) return false;
+        used += entry_size;
+
+        return true;
+    };
 
-    for (auto& pair : dir->children()) {
-        filler(buf, pair.second->name().c_str(), nullptr, 0, FUSE_FILL_DIR_PLUS);
+    if (off < dot_offset && !add(".", dir, dot_offset)) off = -1;
+    if (off >= 0 && off < dotdot_offset) {
+        entry::entry_ref parent = dir->parent() ? entry::entry_ref(dir->parent()) : dir;
+        if (!add("..", parent, dotdot_offset)) off = -1;
     }
 
-    return 0;
+    if (off >= 0) {
+        uint64_t after = off > dotdot_offset ? off - dotdot_offset : 0;
+
+        dir->list(after, [&] (const entry::entry_ref& entry) {
+            if (!add(entry->name().c_str(), entry, dotdot_offset + entry->ino())) return false;
+
+            // The kernel counts every entry of readdirplus as a lookup, except
+            // for . and ..
+            if (plus) remember(entry);
+
+            return true;
+        });
+    }
+
+    fuse_reply_buf(req, buf.get(), used);
+}
+
+static void vram_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info*) {
+    stats::timer timer(stats::op::readdir);
+
+    read_dir(req, ino, size, off, false);
+}
+
+static void vram_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info*) {
+    stats::timer timer(stats::op::readdir);
+
+    read_dir(req, ino, size, off, true);
 }
 
 /*
  * Create file
  */
 
-static int vram_create(const char* path, mode_t, struct fuse_file_info* fi) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, fuse_file_info* fi) {
+    stats::timer timer(stats::op::create);
+    fs_exclusive_lock local_lock;
+
+    if (is_stats_name(parent, name)) return (void) err_reply(req, -EEXIST);
+
+    entry::dir_ref dir;
+    int err = get_dir(parent, dir);
+    if (err != 0) return (void) err_reply(req, err);
 
     // Truncate any existing file entry or fail if it's another type
     entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::file);
-    if (err == -EISDIR) return err;
+    err = dir->child(name, entry, entry::type::file);
+    if (err == -EISDIR) return (void) err_reply(req, err);
     else if (err == 0) entry->unlink();
 
-    string dir, name;
-    util::split_file_path(path, dir, name);
-
-    // Check if parent directory exists
-    err = root_entry->find(dir, entry, entry::type::dir);
-    if (err != 0) return err;
-    auto parent = dynamic_pointer_cast<entry::dir_t>(entry);
-
     // Create new entry with appropriate owner/group
-    auto file = entry::file_t::make(parent.get(), name);
-
-    auto context = fuse_get_context();
-    file->user(context->uid);
-    file->group(context->gid);
+    auto file = entry::file_t::make(dir.get(), name);
+    file->mode(mode & 07777);
+    set_owner(req, file);
 
     // Open it by assigning new file handle
-    fi->fh = reinterpret_cast<uint64_t>(new file_session(file));
+    open_session(fi, file);
 
-    return 0;
+    auto param = entry_param(file);
+    remember(file);
+    fuse_reply_create(req, &param, fi);
 }
 
 /*
  * Create directory
  */
 
-static int vram_mkdir(const char* path, mode_t) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+    stats::timer timer(stats::op::mkdir);
+    fs_exclusive_lock local_lock;
 
-    // Fail if entry with that name already exists
-    entry::entry_ref entry;
-    int err = root_entry->find(path, entry);
-    if (err == 0) return -EEXIST;
+    if (is_stats_name(parent, name)) return (void) err_reply(req, -EEXIST);
 
-    string dir, name;
-    util::split_file_path(path, dir, name);
+    entry::dir_ref dir;
+    int err = get_dir(parent, dir);
+    if (err != 0) return (void) err_reply(req, err);
 
-    // Check if parent directory exists
-    err = root_entry->find(dir, entry, entry::type::dir);
-    if (err != 0) return err;
-    auto parent = dynamic_pointer_cast<entry::dir_t>(entry);
+    // Fail if entry with that name already exists
+    entry::entry_ref entry;
+    err = dir->child(name, entry);
+    if (err == 0) return (void) err_reply(req, -EEXIST);
 
     // Create new directory with appropriate owner/group
-    auto new_dir = entry::dir_t::make(parent.get(), name);
-
-    auto context = fuse_get_context();
-    new_dir->user(context->uid);
-    new_dir->group(context->gid);
+    auto new_dir = entry::dir_t::make(dir.get(), name);
+    new_dir->mode(mode & 07777);
+    set_owner(req, new_dir);
 
-    return 0;
+    reply_entry(req, new_dir);
 }
 
 /*
  * Create symlink
  */
 
-static int vram_symlink(const char* target, const char* path) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_symlink(fuse_req_t req, const char* target, fuse_ino_t parent, const char* name) {
+    stats::timer timer(stats::op::symlink);
+    fs_exclusive_lock local_lock;
 
-    // Fail if an entry with that name already exists
-    entry::entry_ref entry;
-    int err = root_entry->find(path, entry);
-    if (err == 0) return -EEXIST;
+    if (is_stats_name(parent, name)) return (void) err_reply(req, -EEXIST);
 
-    // Split path in parent directory and new symlink name
-    string dir, name;
-    util::split_file_path(path, dir, name);
+    entry::dir_ref dir;
+    int err = get_dir(parent, dir);
+    if (err != 0) return (void) err_reply(req, err);
 
-    // Check if parent directory exists
-    err = root_entry->find(dir, entry, entry::type::dir);
-    if (err != 0) return err;
-    auto parent = dynamic_pointer_cast<entry::dir_t>(entry);
+    // Fail if an entry with that name already exists
+    entry::entry_ref entry;
+    err = dir->child(name, entry);
+    if (err == 0) return (void) err_reply(req, -EEXIST);
 
     // Create new symlink with appropriate owner/group
-    auto symlink = entry::symlink_t::make(parent.get(), name, target);
-
-    auto context = fuse_get_context();
-    symlink->user(context->uid);
-    symlink->group(context->gid);
+    auto symlink = entry::symlink_t::make(dir.get(), name, target);
+    set_owner(req, symlink);
 
-    return 0;
+    reply_entry(req, symlink);
 }
 
 /*
  * Delete file
  */
 
-static int vram_unlink(const char* path) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    stats::timer timer(stats::op::unlink);
+    fs_exclusive_lock local_lock;
+
+    entry::dir_ref dir;
+    int err = get_dir(parent, dir);
+    if (err != 0) return (void) err_reply(req, err);
 
     entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::symlink | entry::type::file);
-    if (err != 0) return err;
+    err = dir->child(name, entry, entry::type::symlink | entry::type::file);
+    if (err != 0) return (void) err_reply(req, err);
 
     entry->unlink();
 
-    return 0;
+    fuse_reply_err(req, 0);
 }
 
 /*
  * Delete directory
  */
 
-static int vram_rmdir(const char* path) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    stats::timer timer(stats::op::rmdir);
+    fs_exclusive_lock local_lock;
+
+    entry::dir_ref dir;
+    int err = get_dir(parent, dir);
+    if (err != 0) return (void) err_reply(req, err);
 
     // Fail if entry doesn't exist or is not a directory
     entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::dir);
-    if (err != 0) return err;
-    auto dir = dynamic_pointer_cast<entry::dir_t>(entry);
+    err = dir->child(name, entry, entry::type::dir);
+    if (err != 0) return (void) err_reply(req, err);
+    auto child_dir = dynamic_pointer_cast<entry::dir_t>(entry);
 
     // Check if directory is empty
-    if (dir->children().size() != 0) {
-        return -ENOTEMPTY;
+    if (!child_dir->empty()) {
+        return (void) err_reply(req, -ENOTEMPTY);
     }
 
-    dir->unlink();
+    child_dir->unlink();
 
-    return 0;
+    fuse_reply_err(req, 0);
 }
 
 /*
  * Rename entry
  */
 
-static int vram_rename(const char* path, const char* new_path, unsigned int) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t new_parent, const char* new_name, unsigned int flags) {
+    stats::timer timer(stats::op::rename);
+    fs_exclusive_lock local_lock;
+
+    if (is_stats_name(new_parent, new_name)) return (void) err_reply(req, -EEXIST);
+
+    // Exchanging entries or refusing to replace them isn't supported
+    if (flags != 0) return (void) err_reply(req, -EINVAL);
+
+    entry::dir_ref dir;
+    int err = get_dir(parent, dir);
+    if (err != 0) return (void) err_reply(req, err);
 
     // Look up entry
     entry::entry_ref entry;
-    int err = root_entry->find(path, entry);
-    if (err != 0) return err;
+    err = dir->child(name, entry);
+    if (err != 0) return (void) err_reply(req, err);
 
     // Check if destination directory exists
-    string dir, new_name;
-    util::split_file_path(new_path, dir, new_name);
-
-    entry::entry_ref parent_entry;
-    err = root_entry->find(dir, parent_entry, entry::type::dir);
-    if (err != 0) return err;
-    auto parent = dynamic_pointer_cast<entry::dir_t>(parent_entry);
+    entry::dir_ref new_dir;
+    err = get_dir(new_parent, new_dir);
+    if (err != 0) return (void) err_reply(req, err);
 
     // If the destination entry already exists, then delete it
     entry::entry_ref dest_entry;
-    err = root_entry->find(new_path, dest_entry);
+    err = new_dir->child(new_name, dest_entry);
     if (err == 0) dest_entry->unlink();
 
-    entry->move(parent.get(), new_name);
+    entry->move(new_dir.get(), new_name);
 
-    return 0;
+    fuse_reply_err(req, 0);
 }
 
 /*
  * Open file
  */
 
-static int vram_open(const char* path, fuse_file_info* fi) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+    stats::timer timer(stats::op::open);
+    fs_shared_lock local_lock;
 
-    entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::file);
-    if (err != 0) return err;
+    if (ino == stats_file_ino) return open_stats(req, fi);
+
+    auto entry = get_entry(ino);
+    if (!entry) return (void) err_reply(req, -ENOENT);
+    if (entry->type() != entry::type::file) return (void) err_reply(req, -EISDIR);
     auto file = dynamic_pointer_cast<entry::file_t>(entry);
 
-    fi->fh = reinterpret_cast<uint64_t>(new file_session(file));
+    open_session(fi, file);
 
-    return 0;
+    fuse_reply_open(req, fi);
 }
 
 /*
  * Read file
  */
 
-static int vram_read(const char* path, char* buf, size_t size, off_t off, fuse_file_info* fi) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, fuse_file_info* fi) {
+    stats::timer timer(stats::op::read);
+
+    if (ino == stats_file_ino) return read_stats(req, size, off, fi);
 
     file_session* session = reinterpret_cast<file_session*>(fi->fh);
-    return session->file->read(off, size, buf, fsmutex);
+
+    // Data is read into pinned memory if possible, since the driver can
+    // transfer into that directly, and it only has to live until the reply
+    // has been sent
+    memory::staging_ref staging;
+    std::unique_ptr<char[]> heap_buf;
+    char* buf;
+
+    if (size <= memory::staging_size) staging = memory::acquire_staging();
+
+    if (staging) {
+        buf = staging->data;
+    } else {
+        heap_buf.reset(new char[size]);
+        buf = heap_buf.get();
+    }
+
+    int r = session->file->read(off, size, buf);
+    if (r < 0) return (void) err_reply(req, r);
+
+    fuse_reply_buf(req, buf, r);
+
+    stats::add(stats::counter::bytes_read, r);
+
+    // Sequential readers get the next blocks prefetched into the host cache
+    if (r > 0 && session->read_end.exchange(off + r) == off) {
+        session->file->prefetch(off + r, read_ahead);
+    }
 }
 
 /*
  * Write file
  */
 
-static int vram_write(const char* path, const char* buf, size_t size, off_t off, fuse_file_info* fi) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void reply_write(fuse_req_t req, int r) {
+    if (r < 0) return (void) err_reply(req, r);
+
+    fuse_reply_write(req, r);
+
+    stats::add(stats::counter::bytes_written, r);
+}
+
+static void vram_write(fuse_req_t req, fuse_ino_t, const char* buf, size_t size, off_t off, fuse_file_info* fi) {
+    stats::timer timer(stats::op::write);
+
+    file_session* session = reinterpret_cast<file_session*>(fi->fh);
+    reply_write(req, session->file->write(off, size, buf, !session->sync_writes));
+}
+
+static void vram_write_buf(fuse_req_t req, fuse_ino_t, fuse_bufvec* buf, off_t off, fuse_file_info* fi) {
+    stats::timer timer(stats::op::write);
 
     file_session* session = reinterpret_cast<file_session*>(fi->fh);
-    return session->file->write(off, size, buf);
+    size_t size = fuse_buf_size(buf);
+
+    // Data that is already in memory doesn't need another copy
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        return reply_write(req, session->file->write(off, size, reinterpret_cast<const char*>(buf->buf[0].mem), !session->sync_writes));
+    }
+
+    int r = session->file->write(off, size, [buf] (char* dst, size_t dst_size) {
+        // Same as FUSE_BUFVEC_INIT, which is a compound literal that isn't valid C++
+        fuse_bufvec dst_buf = {};
+        dst_buf.count = 1;
+        dst_buf.buf[0].size = dst_size;
+        dst_buf.buf[0].mem = dst;
+
+        return fuse_buf_copy(&dst_buf, buf, (fuse_buf_copy_flags) 0) == (ssize_t) dst_size;
+    });
+
+    // Data from a pipe is always written asynchronously
+    if (r > 0 && session->sync_writes) session->file->sync();
+
+    reply_write(req, r);
 }
 
 /*
  * Sync writes to file
  */
 
-static int vram_fsync(const char* path, int, fuse_file_info* fi) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_fsync(fuse_req_t req, fuse_ino_t ino, int, fuse_file_info* fi) {
+    stats::timer timer(stats::op::fsync);
 
+    if (ino == stats_file_ino) return (void) fuse_reply_err(req, 0);
+
+    // The reply is sent once the writes of the file complete, without
+    // holding up this thread in the meantime
     file_session* session = reinterpret_cast<file_session*>(fi->fh);
-    session->file->sync();
+    session->file->sync([req] { fuse_reply_err(req, 0); });
+}
 
-    return 0;
+/*
+ * Start transferring written data when a file descriptor is closed
+ */
+
+static void vram_flush(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+    stats::timer timer(stats::op::flush);
+
+    if (ino != stats_file_ino) {
+        file_session* session = reinterpret_cast<file_session*>(fi->fh);
+        session->file->flush();
+    }
+
+    fuse_reply_err(req, 0);
 }
 
 /*
- * Close file
+ * Allocate or deallocate file space
  */
 
-static int vram_release(const char* path, fuse_file_info* fi) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t off, off_t length, fuse_file_info* fi) {
+    stats::timer timer(stats::op::fallocate);
 
-    delete reinterpret_cast<file_session*>(fi->fh);
+    if (ino == stats_file_ino) return (void) fuse_reply_err(req, EBADF);
 
-    return 0;
+    file_session* session = reinterpret_cast<file_session*>(fi->fh);
+    bool keep_size = mode & FALLOC_FL_KEEP_SIZE;
+    int err = 0;
+
+    if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        err = session->file->punch_hole(off, length);
+    } else if ((mode & ~FALLOC_FL_KEEP_SIZE) == FALLOC_FL_ZERO_RANGE) {
+        err = session->file->zero_range(off, length, keep_size);
+    } else if ((mode & ~FALLOC_FL_KEEP_SIZE) == 0) {
+        err = session->file->preallocate(off, length, keep_size);
+    } else {
+        err = -EOPNOTSUPP;
+    }
+
+    err_reply(req, err);
 }
 
 /*
- * Change file size
+ * Copy data between files
  */
 
-static int vram_truncate(const char* path, off_t size, fuse_file_info*) {
-    lock_guard<mutex> local_lock(fsmutex);
+static void vram_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, fuse_file_info* fi_in,
+        fuse_ino_t ino_out, off_t off_out, fuse_file_info* fi_out, size_t len, int flags) {
+    stats::timer timer(stats::op::copy_file_range);
 
-    entry::entry_ref entry;
-    int err = root_entry->find(path, entry, entry::type::file);
-    if (err != 0) return err;
-    auto file = dynamic_pointer_cast<entry::file_t>(entry);
+    if (flags) return (void) fuse_reply_err(req, EINVAL);
 
-    file->size(size);
+    // The kernel falls back to copying through the page cache
+    if (ino_in == stats_file_ino || ino_out == stats_file_ino) return (void) fuse_reply_err(req, EOPNOTSUPP);
 
-    return 0;
+    file_session* in = reinterpret_cast<file_session*>(fi_in->fh);
+    file_session* out = reinterpret_cast<file_session*>(fi_out->fh);
+
+    // Short copies are allowed, the result has to fit in an int
+    len = std::min(len, (size_t) 1 << 30);
+
+    int r = out->file->copy(off_out, len, *in->file, off_in);
+    if (r < 0) return (void) err_reply(req, r);
+
+    fuse_reply_write(req, r);
+
+    stats::add(stats::counter::bytes_copied, r);
+}
+
+/*
+ * Find data and holes
+ */
+
+static void vram_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, fuse_file_info* fi) {
+    stats::timer timer(stats::op::lseek);
+
+    // Other kinds of seeks are handled by the kernel
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) return (void) fuse_reply_err(req, EINVAL);
+
+    if (ino == stats_file_ino) {
+        off_t size = reinterpret_cast<string*>(fi->fh)->size();
+
+        if (off >= size) return (void) fuse_reply_err(req, ENXIO);
+        return (void) fuse_reply_lseek(req, whence == SEEK_DATA ? off : size);
+    }
+
+    file_session* session = reinterpret_cast<file_session*>(fi->fh);
+    off_t pos = session->file->seek(off, whence);
+
+    if (pos < 0) {
+        err_reply(req, pos);
+    } else {
+        fuse_reply_lseek(req, pos);
+    }
+}
+
+/*
+ * Close file
+ */
+
+static void vram_release(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+    stats::timer timer(stats::op::release);
+
+    if (ino == stats_file_ino) {
+        delete reinterpret_cast<string*>(fi->fh);
+        return (void) fuse_reply_err(req, 0);
+    }
+
+    file_session* session = reinterpret_cast<file_session*>(fi->fh);
+    session->file->flush();
+
+    delete session;
+
+    fuse_reply_err(req, 0);
 }
 
 /*
  * FUSE setup
  */
 
-static struct vram_operations : fuse_operations {
+static struct vram_operations : fuse_lowlevel_ops {
     vram_operations() {
         init = vram_init;
         statfs = vram_statfs;
+        lookup = vram_lookup;
+        forget = vram_forget;
+        forget_multi = vram_forget_multi;
         getattr = vram_getattr;
+        setattr = vram_setattr;
         readlink = vram_readlink;
-        utimens = vram_utimens;
-        chmod = vram_chmod;
-        chown = vram_chown;
+        setxattr = vram_setxattr;
+        getxattr = vram_getxattr;
+        listxattr = vram_listxattr;
+        removexattr = vram_removexattr;
+        opendir = vram_opendir;
         readdir = vram_readdir;
+        readdirplus = vram_readdirplus;
         create = vram_create;
         mkdir = vram_mkdir;
         symlink = vram_symlink;
@@ -458,22 +1135,88 @@ static struct vram_operations : fuse_operations {
         open = vram_open;
         read = vram_read;
         write = vram_write;
+        write_buf = vram_write_buf;
         fsync = vram_fsync;
+        flush = vram_flush;
+        fallocate = vram_fallocate;
+        copy_file_range = vram_copy_file_range;
+        lseek = vram_lseek;
         release = vram_release;
-        truncate = vram_truncate;
     }
 } operations;
 
+/*
+ * Snapshots
+ */
+
+// Image that snapshots are written to, when SIGUSR1 is received and once the
+// disk is unmounted, empty if disabled
+static string snapshot_path;
+
+// Posted by the signal handler, the thread that writes snapshots waits for it
+static sem_t snapshot_request;
+static std::atomic<bool> snapshot_stop(false);
+
+// The signal may arrive while the snapshot of the unmount is being written
+static std::mutex snapshot_mutex;
+
+static void request_snapshot(int) {
+    sem_post(&snapshot_request);
+}
+
+static void write_snapshot() {
+    lock_guard<mutex> snapshot_lock(snapshot_mutex);
+
+    std::cout << "writing snapshot to " << snapshot_path << "..." << std::endl;
+
+    // The tree is captured with all namespace changes held off, the files are
+    // captured by sharing their blocks, so that doesn't take long
+    snapshot::tree tree;
+
+    {
+        fs_exclusive_lock local_lock;
+        if (!snapshot::capture(root_entry.get(), tree)) return;
+    }
+
+    if (snapshot::save(tree, snapshot_path)) {
+        std::cout << "snapshot written." << std::endl;
+    }
+}
+
+static void snapshot_loop() {
+    while (true) {
+        if (sem_wait(&snapshot_request) != 0) continue;
+        if (snapshot_stop) break;
+
+        write_snapshot();
+    }
+}
+
 static int print_help() {
     std::cerr <<
-        "usage: vramfs <mountdir> <size> [-d <device>] [-f]\n\n"
-        "  mountdir    - directory to mount file system, must be empty\n"
-        "  size        - size of the disk in bytes\n"
-        "  -d <device> - specifies identifier of device to use\n"
-        "  -f          - flag that forces mounting, with a smaller size if needed\n\n"
+        "usage: vramfs <mountdir> <size> [-d <devices>] [-b <block size>] [-i <size>] [-r <seconds>] [-f] [-s] [-t <dir>] [-u] [-p <dir>] [-l <image>] [-w <image>] [-n] [-m] [-q <size>]\n\n"
+        "  mountdir        - directory to mount file system, must be empty\n"
+        "  size            - size of the disk in bytes\n"
+        "  -d <devices>    - identifiers of the devices to use, separated by commas\n"
+        "  -b <block size> - size of the first blocks of files: 4K, 64K (default), 1M or 16M\n"
+        "  -i <size>       - allocate only this much at first and grow the disk as needed\n"
+        "  -r <seconds>    - release memory that has been unused for this long (with -i)\n"
+        "  -f              - flag that forces mounting, with a smaller size if needed\n"
+        "  -s              - bypass the page cache and return from writes once they reach the device\n"
+        "  -t <dir>        - move the least recently used data to a file in this directory once the disk is full\n"
+        "  -u              - store blocks with identical contents only once (for trusted data)\n"
+        "  -p <dir>        - copy the contents of this directory into the disk before mounting it\n"
+        "  -l <image>      - restore the contents of a snapshot before mounting (instead of -p)\n"
+        "  -w <image>      - write a snapshot on SIGUSR1 and when unmounting\n"
+        "  -n              - don't bind threads and host memory to the NUMA node of the first device\n"
+        "  -m              - don't lock process pages in memory\n"
+        "  -q <size>       - bytes of asynchronous writes that may be queued per device (default 16M)\n\n"
         "The size may be followed by one of the following multiplicative suffixes: "
         "K=1024, KB=1000, M=1024*1024, MB=1000*1000, G=1024*1024*1024, GB=1000*1000*1000. "
-        "It's rounded up to the nearest multiple of the block size.\n"
+        "It's rounded up to the nearest multiple of 16M.\n\n"
+        "Files switch to the next larger block size once they grow beyond the size "
+        "of their current blocks. With multiple devices, the disk is spread evenly "
+        "over them and consecutive blocks of a file are stored on different devices.\n"
     << std::endl;
 
     auto devices = memory::list_devices();
@@ -494,6 +1237,7 @@ static int print_help() {
 }
 
 static std::regex size_regex("^([0-9]+)([KMG]B?)?$");
+static std::regex device_regex("^[0-9]+$");
 
 static size_t parse_size(const string& param) {
     std::smatch groups;
@@ -513,38 +1257,97 @@ static size_t parse_size(const string& param) {
 
 int main(int argc, char* argv[]) {
     // Check parameter and parse parameters
-    if (argc < 3 || argc > 6) return print_help();
+    if (argc < 3) return print_help();
     if (!std::regex_match(argv[2], size_regex)) return print_help();
-    if (argc == 4 && strcmp(argv[3], "-f") != 0) return print_help();
-    if (argc == 5 && strcmp(argv[3], "-d") != 0) return print_help();
-    if (argc == 6) {
-        if (strcmp(argv[3], "-d") != 0 && strcmp(argv[5], "-f") != 0) {
-            return print_help();
-        }
-    }
 
     size_t disk_size = parse_size(argv[2]);
-    bool force_allocate = (argc == 4 || argc == 6);
+    size_t initial_size = disk_size;
+    unsigned idle_release = 0;
+    bool force_allocate = false;
+    string spill_dir;
+    string preload_dir;
+    string restore_path;
+    bool lock_memory = true;
+
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            // Comma separated list of devices
+            std::vector<size_t> devices;
+            std::stringstream list(argv[++i]);
+            string num;
+
+            while (std::getline(list, num, ',')) {
+                if (!std::regex_match(num, device_regex)) return print_help();
+                devices.push_back(std::stoul(num));
+            }
 
-    if (argc == 5 || argc == 6) {
-        memory::set_device(atoi(argv[4]));
+            if (devices.empty()) return print_help();
+
+            memory::set_devices(devices);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            if (!std::regex_match(argv[++i], size_regex)) return print_help();
+
+            int cls = memory::find_class(parse_size(argv[i]));
+            if (cls < 0) return print_help();
+
+            memory::set_default_class(cls);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            if (!std::regex_match(argv[++i], size_regex)) return print_help();
+
+            initial_size = std::min(parse_size(argv[i]), disk_size);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            idle_release = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            force_allocate = true;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            direct_io = true;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            spill_dir = argv[++i];
+        } else if (strcmp(argv[i], "-u") == 0) {
+            memory::set_dedup(true);
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            preload_dir = argv[++i];
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            restore_path = argv[++i];
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0) {
+            memory::set_numa_binding(false);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            lock_memory = false;
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            if (!std::regex_match(argv[++i], size_regex)) return print_help();
+
+            // Read-ahead gets a quarter of what writes get, since it's only a guess
+            size_t limit = parse_size(argv[i]);
+            memory::set_background_limits(limit, limit / 4);
+        } else {
+            return print_help();
+        }
     }
 
-    // Lock process pages in memory to prevent them from being swapped
-    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
-        std::cerr << "failed to lock process pages in memory, vramfs may freeze if swapped" << std::endl;
-    }
+    if (!preload_dir.empty() && !restore_path.empty()) return print_help();
 
     // Check for OpenCL supported GPU and allocate memory
     if (!memory::is_available()) {
         std::cerr << "no opencl capable gpu found" << std::endl;
         return 1;
     } else {
+        if (memory::numa_node() >= 0) {
+            std::cout << "using numa node " << memory::numa_node() << std::endl;
+        }
+
+        // Lock process pages in memory to prevent them from being swapped, only
+        // now that the thread is bound, because this faults them in
+        if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+            std::cerr << "failed to lock process pages in memory, vramfs may freeze if swapped" << std::endl;
+        }
+
         std::cout << "allocating vram..." << std::endl;
 
-        size_t actual_size = memory::increase_pool(disk_size);
+        size_t actual_size = memory::increase_pool(initial_size);
 
-        if (actual_size < disk_size) {
+        if (actual_size < initial_size) {
             if (force_allocate) {
                 std::cerr << "warning: only allocated " << actual_size << " bytes" << std::endl;
             } else {
@@ -553,12 +1356,55 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
         }
+
+        if (initial_size < disk_size) {
+            memory::grow_pool(disk_size, idle_release);
+        }
+    }
+
+    if (!spill_dir.empty() && !memory::set_spill_dir(spill_dir)) {
+        std::cerr << "error: could not create spill file in " << spill_dir << std::endl;
+        return 1;
+    }
+
+    root_entry = entry::dir_t::make(nullptr, "");
+    root_entry->user(geteuid());
+    root_entry->group(getegid());
+
+    // The tree is filled without the kernel in between, before anything can
+    // access it
+    if (!preload_dir.empty()) {
+        std::cout << "preloading " << preload_dir << "..." << std::endl;
+
+        if (!preload::load(root_entry.get(), preload_dir)) {
+            std::cerr << "cleaning up..." << std::endl;
+            return 1;
+        }
+    }
+
+    if (!restore_path.empty()) {
+        std::cout << "restoring " << restore_path << "..." << std::endl;
+
+        if (!snapshot::restore(root_entry.get(), restore_path)) {
+            std::cerr << "cleaning up..." << std::endl;
+            return 1;
+        }
     }
 
-    // Pass mount point parameter to FUSE
-    struct fuse_args args = FUSE_ARGS_INIT(2, argv);
+    std::thread snapshot_thread;
+
+    if (!snapshot_path.empty()) {
+        sem_init(&snapshot_request, 0, 0);
+        snapshot_thread = std::thread(snapshot_loop);
+
+        struct sigaction action = {};
+        action.sa_handler = request_snapshot;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, nullptr);
+    }
 
-    fuse_opt_parse(&args, nullptr, nullptr, nullptr);
+    struct fuse_args args = FUSE_ARGS_INIT(0, nullptr);
+    fuse_opt_add_arg(&args, argv[0]);
 
     // Properly unmount even on crash
     fuse_opt_add_arg(&args, "-oauto_unmount");
@@ -566,8 +1412,35 @@ int main(int argc, char* argv[]) {
     // Let FUSE and the kernel deal with permissions handling
     fuse_opt_add_arg(&args, "-odefault_permissions");
 
-    // OpenCL driver acts funky if program doesn't keep running in foreground
-    fuse_opt_add_arg(&args, "-f");
+    // The session is never daemonized, because the OpenCL driver acts funky
+    // if the program doesn't keep running in the foreground
+    fuse_session* session = fuse_session_new(&args, &operations, sizeof(operations), nullptr);
+    int r = 1;
+
+    if (session) {
+        if (fuse_set_signal_handlers(session) == 0) {
+            if (fuse_session_mount(session, argv[1]) == 0) {
+                r = fuse_session_loop_mt(session, 0) == 0 ? 0 : 1;
+                fuse_session_unmount(session);
+
+                if (!snapshot_path.empty()) write_snapshot();
+            }
+
+            fuse_remove_signal_handlers(session);
+        }
+
+        fuse_session_destroy(session);
+    }
+
+    fuse_opt_free_args(&args);
+
+    if (snapshot_thread.joinable()) {
+        signal(SIGUSR1, SIG_IGN);
+
+        snapshot_stop = true;
+        sem_post(&snapshot_request);
+        snapshot_thread.join();
+    }
 
-    return fuse_main(args.argc, args.argv, &operations, nullptr);
+    return r;
 }